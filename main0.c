@@ -1,292 +1,4282 @@
+//POSIX and BSD extensions (madvise, posix_fadvise) are hidden by -std=c17 otherwise
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <omp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+//the decoder's and encoder's allocations go to the current image's arena (see arena_malloc)
+void* arena_malloc(size_t size);
+void* arena_realloc(void* p, size_t size);
+void arena_free(void* p);
+#define STBI_MALLOC(size) arena_malloc(size)
+#define STBI_REALLOC(p, size) arena_realloc(p, size)
+#define STBI_FREE(p) arena_free(p)
+#define STBIW_MALLOC(size) arena_malloc(size)
+#define STBIW_REALLOC(p, size) arena_realloc(p, size)
+#define STBIW_FREE(p) arena_free(p)
+//the PNG writer's zlib compression runs in parallel chunks (see deflate_parallel)
+unsigned char* deflate_parallel(unsigned char* data, int data_len, int* out_len, int quality);
+#define STBIW_ZLIB_COMPRESS deflate_parallel
+//and its chunk checksums use the table sliced or carry-less multiply crc-32 (see png_crc32_update)
+unsigned png_crc32(unsigned char* buffer, int len);
+#define STBIW_CRC32 png_crc32
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image/stb_image_write.h"
+
+//defaults for the run settings below, each can be overridden on the command line
+
+//folder locations
+#define INPUT_FOLDER "image_input/"
+#define OUTPUT_FOLDER "image_output/"
+
+//thread count
+#define NUM_THREADS 16
+
+//pipeline mode: 1 splits work into loader, processing and writer stages connected by bounded queues,
+//0 has each thread load, process and write its own images
+#define PIPELINE_MODE 0
+//per stage thread counts used by pipeline mode
+#define LOAD_THREADS 4
+#define PROCESS_THREADS 8
+#define WRITE_THREADS 4
+//max images waiting between two stages
+#define QUEUE_DEPTH 16
+//max files found by recursive input discovery that are waiting to be started
+#define DISCOVERY_DEPTH 256
+
+//input reading: 1 decodes each file from a read only memory mapping, 0 through stbi_load's buffered stdio reads
+#define MMAP_INPUT 0
+
+//read-ahead: up to PREFETCH_FILES upcoming input files (0 disables it) are read into memory by PREFETCH_THREADS
+//background threads, as long as they hold no more than PREFETCH_BYTES together
+#define PREFETCH_FILES 0
+#define PREFETCH_THREADS 4
+#define PREFETCH_BYTES (256L * 1024 * 1024)
+
+//file I/O: 1 opens, reads, writes and closes files through batched io_uring submissions (Linux only, falls back
+//to blocking I/O where io_uring is unavailable), 0 uses blocking system calls and stdio
+#define IO_URING 0
+//max files the read-ahead opens and reads together with io_uring, 2 submissions per batch
+#define URING_BATCH 32
+//the decoder's and encoder's small allocations come from an arena that is handed to another image as soon as the
+//image is decoded (or encoded), large ones are buffer pool buffers. Arenas start at ARENA_CHUNK bytes and grow as needed, one that has grown past
+//ARENA_BYTES is freed instead of kept, so a few huge images don't pin their memory for the rest of the run
+#define ARENA_CHUNK (1024 * 1024)
+#define ARENA_BYTES (64L * 1024 * 1024)
+//buffer pool: image sized buffers are reused through power of two size classes starting at POOL_MIN_SIZE bytes,
+//up to POOL_BYTES of free buffers are kept. POOL_HUGE_PAGES 1 asks for transparent huge pages on buffers of 2 MB
+//and up, which cuts page faults and TLB misses on large images at the cost of more memory per buffer
+#define POOL_MIN_SIZE 4096
+#define POOL_CLASSES 36
+#define POOL_BYTES (512L * 1024 * 1024)
+#define POOL_HUGE_PAGES 0
+//output files: 1 writes each image to a temporary file renamed over the output once complete, 0 writes the output directly
+#define ATOMIC_OUTPUT 0
+
+//PNG compression: the filtered image is deflated in chunks of DEFLATE_CHUNK bytes compressed in parallel, each using
+//the 32 KB before it as its dictionary, and joined into one zlib stream. 0 compresses each image in one piece
+#define DEFLATE_CHUNK (256 * 1024)
+//PNG compression level, 0 (stored) to 9: higher levels search further back for matches
+#define PNG_LEVEL 8
+//levels up to this one code PNG data with the fixed huffman codes, higher ones build codes for each block
+#define DEFLATE_FIXED_LEVEL 1
+
+//jpeg to jpeg jobs with only flips and rotations move the compressed DCT blocks instead of decoding and re-encoding
+#define LOSSLESS_JPEG 1
+
+//greyscale formula: GRAY_AVERAGE (r+g+b)/3, or luminance weighted GRAY_BT601 / GRAY_BT709
+#define GRAYSCALE_MODE GRAY_AVERAGE
+
+
+//1 thread results in serialization
+//n threads where n is the number of images results in each image being worked on, and threads that finish their image early help out on the tiles of images still being processed.
+//>n threads results in right away processing speedups for as many extra threads exist.
+
+//pixels per intra-image task, operations split each image into tiles of about this size that idle threads can pick up
+#define TILE_PIXELS (64 * 1024)
+//side in pixels of the tiles 90 and 270 degree rotations are copied in, 0 sizes them from the L1 data cache at startup
+#define TRANSPOSE_TILE 0
+
+
+//greyscale formulas
+enum gray_mode { GRAY_AVERAGE, GRAY_BT601, GRAY_BT709 };
+
+//best instruction set available at runtime, kernels fall back to scalar code below their level
+enum cpu_level { CPU_SCALAR, CPU_SSE2, CPU_SSSE3, CPU_AVX2, CPU_AVX512VBMI };
+int cpu_level = CPU_SCALAR;
+//carry-less multiply (PCLMULQDQ with SSE4.1) is available, for crc-32
+int cpu_clmul = 0;
+//L1 data cache size in bytes, used to size the rotation tiles
+long l1_cache_size = 32 * 1024;
+
+//per pixel color operations, a color matrix (sepia, swap, saturation, hue, tint, brightness) can be followed by greyscale
+enum color_op { COLOR_NONE = 0, COLOR_MATRIX = 1, COLOR_GRAYSCALE = 2 };
+
+//one of the 8 flip/rotate combinations, as the matrix mapping source pixel positions (relative to
+//the image center) to destination positions, so a chain of flips and rotations composes into one
+struct transform {
+    int m[2][2];
+};
+
+//color matrix: out_c = m[c][0]*r + m[c][1]*g + m[c][2]*b + m[c][3], alpha passes through unchanged
+struct color_matrix {
+    float m[3][4];
+};
+
+//selected operations
+struct operations {
+    int greyscale, sepia, hflip, vflip, rotate, rotation;
+    enum gray_mode gray_mode;
+    //color matrix operations, saturation 1, hue 0 and brightness 0 leave the image unchanged
+    int swap, tint;
+    float saturation, hue, brightness;
+    unsigned char tint_color[3];
+    //an --ops list is applied in the order it is given: its flips and rotations are composed into
+    //transform and its color operations into matrix while parsing, the flags above only describe it
+    int ordered;
+    struct transform transform;
+    struct color_matrix matrix;
+};
+
+//color matrix converted for the integer kernels
+//each output channel is clamp((c0*r + c1*g + c2*b + offset) >> shift, 0, 255) where the coefficients are
+//rounded to 1/2^shift and offset includes the rounding half, so results round half up
+//shift is 14 unless a coefficient needs more than 16 signed bits at that precision
+struct fixed_matrix {
+    int c[3][3];
+    int offset[3];
+    int shift;
+    int simd; //coefficients fit the 16-bit lanes of the SIMD kernels
+};
+
+//the selected operations reduced to one color operation and one transform, run as a single pass
+struct process_plan {
+    enum color_op color;
+    struct fixed_matrix matrix;
+    enum gray_mode gray_mode;
+    struct transform transform;
+};
+
+//an image's pixels and layout, operations read a source buffer and write a destination buffer (see prepare_output)
+struct image_buffer {
+    unsigned char* pixels;
+    int width, height, channels;
+};
+
+//input file with its estimated cost from a header-only scan, used to schedule largest images first
+struct file_entry {
+    char* filename;
+    size_t est_cost; //width * height * channels, 0 if the header could not be read
+    double actual;   //seconds spent loading, processing and writing
+};
+
+//a single image as it moves through loading, processing and writing
+struct image_job {
+    char* filename;
+    struct file_entry* entry;
+    double seconds; //time spent in stages so far, excluding queue waits
+    //the image as loaded or processed so far, operations returning a new buffer replace it, so a job only holds one buffer
+    struct image_buffer image;
+    int from_stbi; //image.pixels came from stbi_load and is released with stbi_image_free
+    //file contents read ahead by a prefetcher, decoded instead of reading the file when set
+    unsigned char* data;
+    size_t data_size;
+    struct prefetcher* prefetcher;
+    struct arena* arena; //holds the decoder's or encoder's small allocations while it works on this image
+};
+
+//bounded queue handing images from one pipeline stage to the next
+struct job_queue {
+    struct image_job** items;
+    int capacity, head, count;
+    int producers; //stages still pushing, queue is closed once this reaches 0
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+
+//run settings, start out as the defines above and are overridden by command line flags
+struct settings {
+    const char* input_folder;
+    const char* output_folder;
+    int num_threads;
+    int pipeline_mode, load_threads, process_threads, write_threads, queue_depth;
+    int dry_run; //only scan the inputs and print the plan
+    int recursive; //process every image under the input folder, found while the batch runs
+    int mmap_input;
+    int prefetch_files, prefetch_threads;
+    long prefetch_bytes;
+    int io_uring;
+    int atomic_output;
+    int huge_pages;
+    int lossless_jpeg;
+    int png_level;
+    int self_test; //compare every SIMD kernel the cpu supports against the scalar code, then exit
+};
+struct settings settings = { INPUT_FOLDER, OUTPUT_FOLDER, NUM_THREADS,
+    PIPELINE_MODE, LOAD_THREADS, PROCESS_THREADS, WRITE_THREADS, QUEUE_DEPTH, 0, 0, MMAP_INPUT,
+    PREFETCH_FILES, PREFETCH_THREADS, PREFETCH_BYTES, IO_URING, ATOMIC_OUTPUT, POOL_HUGE_PAGES, LOSSLESS_JPEG, PNG_LEVEL, 0 };
+
+//where a run takes its images from: the pre-scanned and sorted file entries, or a bounded queue fed
+//by a directory walk so images start as soon as they are found
+struct job_source {
+    struct file_entry* entries;
+    int file_count, next_file;
+    struct job_queue* queue; //used instead of entries when set (directory discovery or read-ahead)
+    //totals of images without a file entry
+    int finished;
+    double seconds;
+};
+
+//read-ahead stage between a job source and the loaders: threads read whole input files into memory in
+//processing order, so decoding works from memory instead of waiting on storage. The ready queue bounds how
+//many files are held, and the byte budget how much memory they take
+struct prefetcher {
+    struct job_source* files;
+    struct job_source output; //source the run takes the read-ahead jobs from
+    struct job_queue ready;
+    size_t budget, used;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    pthread_t* threads;
+    int thread_count;
+};
+
+
+//rows per intra-image task for row based loops
+int tile_rows(int width) {
+    int rows = TILE_PIXELS / (width > 0 ? width : 1);
+    return rows > 0 ? rows : 1;
+}
+
+//joins a folder and a file name, adding the separator if the folder does not end in one
+//returns 0 if the path was truncated
+int join_path(char* path, size_t size, const char* folder, const char* filename) {
+    size_t n = strlen(folder);
+    return snprintf(path, size, "%s%s%s", folder, (n > 0 && folder[n - 1] != '/') ? "/" : "", filename) < (int)size;
+}
+
+//builds the input folder path for a file, returns 0 if the path was truncated
+int input_path(char* path, size_t size, const char* filename) {
+    return join_path(path, size, settings.input_folder, filename);
+}
+
+//returns file extension by finding last "." in a string
+char* get_filename_ext(char* filename) {
+    char* dot = strrchr(filename, '.');
+    return (!dot || dot == filename) ? "" : dot + 1;
+}
+
+//sets cpu_level and cpu_clmul from the running cpu's features, and l1_cache_size
+void detect_cpu(void) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi")) cpu_level = CPU_AVX512VBMI;
+    else if (__builtin_cpu_supports("avx2")) cpu_level = CPU_AVX2;
+    else if (__builtin_cpu_supports("ssse3")) cpu_level = CPU_SSSE3;
+    else if (__builtin_cpu_supports("sse2")) cpu_level = CPU_SSE2;
+    cpu_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    if (l1 > 0) l1_cache_size = l1;
+#endif
+}
+
+//luminance weights in 1/256 units (r, g, b), gray = (wr*r + wg*g + wb*b + 128) >> 8
+//GRAY_AVERAGE sums with weight 1 and divides by 3 exactly
+const short GRAY_WEIGHTS[3][3] = { { 1, 1, 1 }, { 77, 150, 29 }, { 54, 183, 19 } };
+
+#ifdef SIMD_X86
+//SIMD greyscale works on 16-bit lanes holding [r, b] and [g, a or 0] of each pixel, so one multiply-add
+//pair gives each pixel's weighted sum as a 32-bit lane. Each kernel returns how many pixels it did,
+//the rest are left to the scalar loop.
+
+//reduces two vectors of four 32-bit pixel sums to eight 16-bit gray values
+__attribute__((target("sse2")))
+static inline __m128i gray_finish_sse2(__m128i s0, __m128i s1, int gray_mode) {
+    if (gray_mode == GRAY_AVERAGE) {
+        //x / 3 == (x * 0xAAAB) >> 17 for every sum up to 765
+        __m128i sum = _mm_packs_epi32(s0, s1);
+        return _mm_srli_epi16(_mm_mulhi_epu16(sum, _mm_set1_epi16((short)0xAAAB)), 1);
+    }
+    __m128i round = _mm_set1_epi32(128);
+    s0 = _mm_srli_epi32(_mm_add_epi32(s0, round), 8);
+    s1 = _mm_srli_epi32(_mm_add_epi32(s1, round), 8);
+    return _mm_packs_epi32(s0, s1);
+}
+
+//rgba -> gray + alpha, 16 pixels per iteration
+__attribute__((target("sse2")))
+size_t grayscale4_sse2(unsigned char* img, unsigned char* output_img, size_t count, int gray_mode) {
+    const short* w = GRAY_WEIGHTS[gray_mode];
+    __m128i w_rb = _mm_set_epi16(w[2], w[0], w[2], w[0], w[2], w[0], w[2], w[0]);
+    __m128i w_ga = _mm_set_epi16(0, w[1], 0, w[1], 0, w[1], 0, w[1]);
+    __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i sum[4], alpha[4];
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(img + (i + 4 * k) * 4));
+            sum[k] = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(v, low_bytes), w_rb), _mm_madd_epi16(_mm_srli_epi16(v, 8), w_ga));
+            alpha[k] = _mm_srli_epi32(v, 24);
+        }
+        __m128i gray = _mm_packus_epi16(gray_finish_sse2(sum[0], sum[1], gray_mode), gray_finish_sse2(sum[2], sum[3], gray_mode));
+        __m128i a = _mm_packus_epi16(_mm_packs_epi32(alpha[0], alpha[1]), _mm_packs_epi32(alpha[2], alpha[3]));
+        _mm_storeu_si128((__m128i*)(output_img + i * 2), _mm_unpacklo_epi8(gray, a));
+        _mm_storeu_si128((__m128i*)(output_img + i * 2 + 16), _mm_unpackhi_epi8(gray, a));
+    }
+    return i;
+}
+
+//rgb -> gray, 16 pixels per iteration, pshufb spreads each 12 byte group of 4 pixels into 16-bit lanes
+__attribute__((target("ssse3")))
+size_t grayscale3_ssse3(unsigned char* img, unsigned char* output_img, size_t count, int gray_mode) {
+    const short* w = GRAY_WEIGHTS[gray_mode];
+    __m128i w_rb = _mm_set_epi16(w[2], w[0], w[2], w[0], w[2], w[0], w[2], w[0]);
+    __m128i w_g0 = _mm_set_epi16(0, w[1], 0, w[1], 0, w[1], 0, w[1]);
+    __m128i rb_mask = _mm_setr_epi8(0, -1, 2, -1, 3, -1, 5, -1, 6, -1, 8, -1, 9, -1, 11, -1);
+    __m128i g_mask = _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    size_t i = 0;
+    //16 byte loads of 12 byte groups read 4 bytes past the last pixel used, keep them inside the row
+    for (; i + 18 <= count; i += 16) {
+        __m128i sum[4];
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(img + (i + 4 * k) * 3));
+            sum[k] = _mm_add_epi32(_mm_madd_epi16(_mm_shuffle_epi8(v, rb_mask), w_rb), _mm_madd_epi16(_mm_shuffle_epi8(v, g_mask), w_g0));
+        }
+        __m128i gray = _mm_packus_epi16(gray_finish_sse2(sum[0], sum[1], gray_mode), gray_finish_sse2(sum[2], sum[3], gray_mode));
+        _mm_storeu_si128((__m128i*)(output_img + i), gray);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gray_finish_avx2(__m256i s0, __m256i s1, int gray_mode) {
+    if (gray_mode == GRAY_AVERAGE) {
+        __m256i sum = _mm256_packs_epi32(s0, s1);
+        return _mm256_srli_epi16(_mm256_mulhi_epu16(sum, _mm256_set1_epi16((short)0xAAAB)), 1);
+    }
+    __m256i round = _mm256_set1_epi32(128);
+    s0 = _mm256_srli_epi32(_mm256_add_epi32(s0, round), 8);
+    s1 = _mm256_srli_epi32(_mm256_add_epi32(s1, round), 8);
+    return _mm256_packs_epi32(s0, s1);
+}
+
+//both layouts, 32 pixels per iteration
+//packs work per 128-bit lane, so the packed bytes come out in groups of 4 pixels that get permuted back in order
+__attribute__((target("avx2")))
+size_t grayscale_avx2(unsigned char* img, unsigned char* output_img, size_t count, int channels, int gray_mode) {
+    const short* w = GRAY_WEIGHTS[gray_mode];
+    __m256i w_rb = _mm256_set_epi16(w[2], w[0], w[2], w[0], w[2], w[0], w[2], w[0], w[2], w[0], w[2], w[0], w[2], w[0], w[2], w[0]);
+    __m256i w_g = _mm256_set_epi16(0, w[1], 0, w[1], 0, w[1], 0, w[1], 0, w[1], 0, w[1], 0, w[1], 0, w[1]);
+    __m256i low_bytes = _mm256_set1_epi16(0x00ff);
+    __m256i rb_mask = _mm256_setr_epi8(0, -1, 2, -1, 3, -1, 5, -1, 6, -1, 8, -1, 9, -1, 11, -1,
+        0, -1, 2, -1, 3, -1, 5, -1, 6, -1, 8, -1, 9, -1, 11, -1);
+    __m256i g_mask = _mm256_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+        1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    //rgb reads 4 bytes past the last pixel used by each 12 byte group
+    size_t end = (channels == 4) ? count : (count >= 2 ? count - 2 : 0);
+    for (; i + 32 <= end; i += 32) {
+        __m256i sum[4], alpha[4];
+        for (int k = 0; k < 4; k++) {
+            if (channels == 4) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(img + (i + 8 * k) * 4));
+                sum[k] = _mm256_add_epi32(_mm256_madd_epi16(_mm256_and_si256(v, low_bytes), w_rb), _mm256_madd_epi16(_mm256_srli_epi16(v, 8), w_g));
+                alpha[k] = _mm256_srli_epi32(v, 24);
+            }
+            else {
+                const unsigned char* p = img + (i + 8 * k) * 3;
+                __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)), _mm_loadu_si128((const __m128i*)(p + 12)), 1);
+                sum[k] = _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(v, rb_mask), w_rb), _mm256_madd_epi16(_mm256_shuffle_epi8(v, g_mask), w_g));
+            }
+        }
+        __m256i gray = _mm256_packus_epi16(gray_finish_avx2(sum[0], sum[1], gray_mode), gray_finish_avx2(sum[2], sum[3], gray_mode));
+        gray = _mm256_permutevar8x32_epi32(gray, order);
+        if (channels == 4) {
+            __m256i a = _mm256_packus_epi16(_mm256_packs_epi32(alpha[0], alpha[1]), _mm256_packs_epi32(alpha[2], alpha[3]));
+            a = _mm256_permutevar8x32_epi32(a, order);
+            __m256i lo = _mm256_unpacklo_epi8(gray, a), hi = _mm256_unpackhi_epi8(gray, a);
+            _mm256_storeu_si256((__m256i*)(output_img + i * 2), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(output_img + i * 2 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+        else _mm256_storeu_si256((__m256i*)(output_img + i), gray);
+    }
+    return i;
+}
+#endif
+
+//Grayscale takes average (or luminance weighted sum) of rgb values into a single channel, for count pixels
+void grayscale_row(unsigned char* img, unsigned char* output_img, size_t count, int channels, int output_channels, int gray_mode) {
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (cpu_level >= CPU_AVX2) i = grayscale_avx2(img, output_img, count, channels, gray_mode);
+    else if (cpu_level >= CPU_SSSE3 && channels == 3) i = grayscale3_ssse3(img, output_img, count, gray_mode);
+    else if (cpu_level >= CPU_SSE2 && channels == 4) i = grayscale4_sse2(img, output_img, count, gray_mode);
+#endif
+    const short* w = GRAY_WEIGHTS[gray_mode];
+    for (; i < count; ++i) {
+        unsigned char* p = img + i * channels;
+        unsigned char* pg = output_img + i * output_channels;
+        if (gray_mode == GRAY_AVERAGE) pg[0] = (p[0] + p[1] + p[2]) / 3;
+        else pg[0] = (w[0] * p[0] + w[1] * p[1] + w[2] * p[2] + 128) >> 8;
+        if (channels == 4) pg[1] = p[3];
+    }
+}
+
+const struct color_matrix IDENTITY_COLOR_MATRIX = { { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } };
+const struct color_matrix SEPIA_MATRIX = { {
+    { 0.393f, 0.769f, 0.189f, 0 },
+    { 0.349f, 0.686f, 0.168f, 0 },
+    { 0.272f, 0.534f, 0.131f, 0 },
+} };
+//swaps red and blue
+const struct color_matrix SWAP_MATRIX = { { { 0, 0, 1, 0 }, { 0, 1, 0, 0 }, { 1, 0, 0, 0 } } };
+
+//applies op after the matrix already in m
+void color_matrix_then(struct color_matrix* m, const struct color_matrix* op) {
+    struct color_matrix r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = op->m[i][0] * m->m[0][j] + op->m[i][1] * m->m[1][j] + op->m[i][2] * m->m[2][j];
+        }
+        r.m[i][3] += op->m[i][3];
+    }
+    *m = r;
+}
+
+//s = 0 gives greyscale, 1 unchanged, >1 more saturated (BT.601 luma is kept)
+struct color_matrix saturation_matrix(float s) {
+    const float w[3] = { 0.299f, 0.587f, 0.114f };
+    struct color_matrix m = IDENTITY_COLOR_MATRIX;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) m.m[i][j] = (1 - s) * w[j] + (i == j ? s : 0);
+    }
+    return m;
+}
+
+//rotates hue by degrees, keeping luminance (same matrix as SVG's hueRotate)
+struct color_matrix hue_matrix(float degrees) {
+    float c = cosf(degrees * 3.14159265f / 180), s = sinf(degrees * 3.14159265f / 180);
+    return (struct color_matrix){ {
+        { 0.213f + c * 0.787f - s * 0.213f, 0.715f - c * 0.715f - s * 0.715f, 0.072f - c * 0.072f + s * 0.928f, 0 },
+        { 0.213f - c * 0.213f + s * 0.143f, 0.715f + c * 0.285f + s * 0.140f, 0.072f - c * 0.072f - s * 0.283f, 0 },
+        { 0.213f - c * 0.213f - s * 0.787f, 0.715f - c * 0.715f + s * 0.715f, 0.072f + c * 0.928f + s * 0.072f, 0 },
+    } };
+}
+
+//scales each channel by the tint color / 255
+struct color_matrix tint_matrix(const unsigned char color[3]) {
+    struct color_matrix m = { 0 };
+    for (int i = 0; i < 3; i++) m.m[i][i] = color[i] / 255.0f;
+    return m;
+}
+
+//adds offset to every channel
+struct color_matrix brightness_matrix(float offset) {
+    struct color_matrix m = IDENTITY_COLOR_MATRIX;
+    for (int i = 0; i < 3; i++) m.m[i][3] = offset;
+    return m;
+}
+
+//largest fixed point coefficient or offset, anything past it saturates every pixel anyway
+#define FIXED_MATRIX_LIMIT (1 << 30)
+
+static inline int fixed_value(float v) {
+    return (int)lrintf(fmaxf(-FIXED_MATRIX_LIMIT, fminf(v, FIXED_MATRIX_LIMIT)));
+}
+
+//scales m by 2^shift, with the largest shift (up to 14) that keeps the coefficients within 16 bits
+//for the SIMD multiply-adds; matrices whose coefficients don't fit even at shift 0 (e.g. sat=1e5)
+//are left to the scalar loop
+void fix_color_matrix(struct fixed_matrix* f, const struct color_matrix* m) {
+    float largest = 0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) largest = fmaxf(largest, fabsf(m->m[i][j]));
+    }
+    f->shift = 14;
+    while (f->shift > 0 && largest * (1 << f->shift) >= 32767) f->shift--;
+    f->simd = largest * (1 << f->shift) < 32767;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) f->c[i][j] = fixed_value(m->m[i][j] * (1 << f->shift));
+        f->offset[i] = fixed_value(m->m[i][3] * (1 << f->shift)) + ((1 << f->shift) >> 1);
+    }
+}
+
+#ifdef SIMD_X86
+//SIMD color matrices use the same [r, b] / [g, a or 0] 16-bit lanes as greyscale, one multiply-add pair per
+//output channel gives 32-bit sums that are shifted down and clamped by the saturating packs
+
+//two 16-bit coefficients as the [lo, hi] lane pair madd multiplies against
+static inline int coefficient_pair(int lo, int hi) {
+    return (int)(((unsigned)hi << 16) | ((unsigned)lo & 0xffff));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i matrix_channel_sse2(__m128i rb, __m128i gx, const struct fixed_matrix* f, int c) {
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32(coefficient_pair(f->c[c][0], f->c[c][2]))),
+        _mm_madd_epi16(gx, _mm_set1_epi32(f->c[c][1] & 0xffff)));
+    return _mm_sra_epi32(_mm_add_epi32(sum, _mm_set1_epi32(f->offset[c])), _mm_cvtsi32_si128(f->shift));
+}
+
+//8 pixels of 32-bit r, g, b results (two vectors each) and 16-bit alpha back to interleaved rgba bytes
+__attribute__((target("sse2")))
+static inline void matrix_pack_sse2(__m128i r[2], __m128i g[2], __m128i b[2], __m128i a, __m128i* out0, __m128i* out1) {
+    __m128i rg = _mm_packus_epi16(_mm_packs_epi32(r[0], r[1]), _mm_packs_epi32(g[0], g[1]));
+    __m128i ba = _mm_packus_epi16(_mm_packs_epi32(b[0], b[1]), a);
+    rg = _mm_unpacklo_epi8(rg, _mm_unpackhi_epi64(rg, rg));
+    ba = _mm_unpacklo_epi8(ba, _mm_unpackhi_epi64(ba, ba));
+    *out0 = _mm_unpacklo_epi16(rg, ba);
+    *out1 = _mm_unpackhi_epi16(rg, ba);
+}
+
+//rgba, 8 pixels per iteration, alpha passes through
+__attribute__((target("sse2")))
+size_t matrix4_sse2(unsigned char* img, unsigned char* output_img, size_t count, const struct fixed_matrix* f) {
+    __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i r[2], g[2], b[2], a[2];
+        for (int k = 0; k < 2; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(img + (i + 4 * k) * 4));
+            __m128i rb = _mm_and_si128(v, low_bytes), ga = _mm_srli_epi16(v, 8);
+            r[k] = matrix_channel_sse2(rb, ga, f, 0);
+            g[k] = matrix_channel_sse2(rb, ga, f, 1);
+            b[k] = matrix_channel_sse2(rb, ga, f, 2);
+            a[k] = _mm_srli_epi32(v, 24);
+        }
+        __m128i out0, out1;
+        matrix_pack_sse2(r, g, b, _mm_packs_epi32(a[0], a[1]), &out0, &out1);
+        _mm_storeu_si128((__m128i*)(output_img + i * 4), out0);
+        _mm_storeu_si128((__m128i*)(output_img + i * 4 + 16), out1);
+    }
+    return i;
+}
+
+//writes the 12 rgb bytes of 4 pixels, exactly, so rows can be converted in place
+__attribute__((target("ssse3")))
+static inline void store_rgb4_ssse3(unsigned char* dst, __m128i rgba) {
+    __m128i rgb = _mm_shuffle_epi8(rgba, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+    _mm_storel_epi64((__m128i*)dst, rgb);
+    int tail = _mm_cvtsi128_si32(_mm_srli_si128(rgb, 8));
+    memcpy(dst + 8, &tail, 4);
+}
+
+//rgb, 8 pixels per iteration
+__attribute__((target("ssse3")))
+size_t matrix3_ssse3(unsigned char* img, unsigned char* output_img, size_t count, const struct fixed_matrix* f) {
+    __m128i rb_mask = _mm_setr_epi8(0, -1, 2, -1, 3, -1, 5, -1, 6, -1, 8, -1, 9, -1, 11, -1);
+    __m128i g_mask = _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    size_t i = 0;
+    //16 byte loads of 12 byte groups read 4 bytes past the last pixel used
+    for (; i + 10 <= count; i += 8) {
+        __m128i r[2], g[2], b[2];
+        for (int k = 0; k < 2; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(img + (i + 4 * k) * 3));
+            __m128i rb = _mm_shuffle_epi8(v, rb_mask), g0 = _mm_shuffle_epi8(v, g_mask);
+            r[k] = matrix_channel_sse2(rb, g0, f, 0);
+            g[k] = matrix_channel_sse2(rb, g0, f, 1);
+            b[k] = matrix_channel_sse2(rb, g0, f, 2);
+        }
+        __m128i out0, out1;
+        matrix_pack_sse2(r, g, b, _mm_setzero_si128(), &out0, &out1);
+        store_rgb4_ssse3(output_img + i * 3, out0);
+        store_rgb4_ssse3(output_img + i * 3 + 12, out1);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i matrix_channel_avx2(__m256i rb, __m256i gx, const struct fixed_matrix* f, int c) {
+    __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(rb, _mm256_set1_epi32(coefficient_pair(f->c[c][0], f->c[c][2]))),
+        _mm256_madd_epi16(gx, _mm256_set1_epi32(f->c[c][1] & 0xffff)));
+    return _mm256_sra_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(f->offset[c])), _mm_cvtsi32_si128(f->shift));
+}
+
+//both layouts, 16 pixels per iteration
+//every step works within 128-bit lanes, and each lane holds 4 consecutive pixels of a load, so the
+//results come out of the lane-wise packs and unpacks already in pixel order
+__attribute__((target("avx2")))
+size_t matrix_avx2(unsigned char* img, unsigned char* output_img, size_t count, int channels, const struct fixed_matrix* f) {
+    __m256i low_bytes = _mm256_set1_epi16(0x00ff);
+    __m256i rb_mask = _mm256_setr_epi8(0, -1, 2, -1, 3, -1, 5, -1, 6, -1, 8, -1, 9, -1, 11, -1,
+        0, -1, 2, -1, 3, -1, 5, -1, 6, -1, 8, -1, 9, -1, 11, -1);
+    __m256i g_mask = _mm256_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+        1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    size_t i = 0;
+    size_t end = (channels == 4) ? count : (count >= 2 ? count - 2 : 0);
+    for (; i + 16 <= end; i += 16) {
+        __m256i r[2], g[2], b[2], a[2];
+        for (int k = 0; k < 2; k++) {
+            __m256i rb, gx;
+            if (channels == 4) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(img + (i + 8 * k) * 4));
+                rb = _mm256_and_si256(v, low_bytes);
+                gx = _mm256_srli_epi16(v, 8);
+                a[k] = _mm256_srli_epi32(v, 24);
+            }
+            else {
+                const unsigned char* p = img + (i + 8 * k) * 3;
+                __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)), _mm_loadu_si128((const __m128i*)(p + 12)), 1);
+                rb = _mm256_shuffle_epi8(v, rb_mask);
+                gx = _mm256_shuffle_epi8(v, g_mask);
+                a[k] = _mm256_setzero_si256();
+            }
+            r[k] = matrix_channel_avx2(rb, gx, f, 0);
+            g[k] = matrix_channel_avx2(rb, gx, f, 1);
+            b[k] = matrix_channel_avx2(rb, gx, f, 2);
+        }
+        __m256i rg = _mm256_packus_epi16(_mm256_packs_epi32(r[0], r[1]), _mm256_packs_epi32(g[0], g[1]));
+        __m256i ba = _mm256_packus_epi16(_mm256_packs_epi32(b[0], b[1]), _mm256_packs_epi32(a[0], a[1]));
+        rg = _mm256_unpacklo_epi8(rg, _mm256_unpackhi_epi64(rg, rg));
+        ba = _mm256_unpacklo_epi8(ba, _mm256_unpackhi_epi64(ba, ba));
+        __m256i out0 = _mm256_unpacklo_epi16(rg, ba), out1 = _mm256_unpackhi_epi16(rg, ba);
+        if (channels == 4) {
+            _mm256_storeu_si256((__m256i*)(output_img + i * 4), out0);
+            _mm256_storeu_si256((__m256i*)(output_img + i * 4 + 32), out1);
+        }
+        else {
+            unsigned char* dst = output_img + i * 3;
+            store_rgb4_ssse3(dst, _mm256_castsi256_si128(out0));
+            store_rgb4_ssse3(dst + 12, _mm256_extracti128_si256(out0, 1));
+            store_rgb4_ssse3(dst + 24, _mm256_castsi256_si128(out1));
+            store_rgb4_ssse3(dst + 36, _mm256_extracti128_si256(out1, 1));
+        }
+    }
+    return i;
+}
+#endif
+
+//Apply color matrix to rgb values, for count pixels (output_img may be img)
+void color_matrix_row(unsigned char* img, unsigned char* output_img, size_t count, int channels, const struct fixed_matrix* f) {
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (f->simd) {
+        if (cpu_level >= CPU_AVX2) i = matrix_avx2(img, output_img, count, channels, f);
+        else if (cpu_level >= CPU_SSSE3 && channels == 3) i = matrix3_ssse3(img, output_img, count, f);
+        else if (cpu_level >= CPU_SSE2 && channels == 4) i = matrix4_sse2(img, output_img, count, f);
+    }
+#endif
+    for (; i < count; ++i) {
+        unsigned char* p = img + i * channels;
+        unsigned char* pg = output_img + i * channels;
+        int r = p[0], g = p[1], b = p[2];
+        for (int c = 0; c < 3; c++) {
+            //64-bit sums, coefficients of the scalar only matrices go up to FIXED_MATRIX_LIMIT
+            long long v = ((long long)f->c[c][0] * r + (long long)f->c[c][1] * g + (long long)f->c[c][2] * b + f->offset[c]) >> f->shift;
+            pg[c] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+        if (channels == 4) pg[3] = p[3];
+    }
+}
+
+//applies the color operation to count contiguous pixels
+//matrix followed by greyscale goes through a small buffer a chunk of pixels at a time
+void color_row(const struct process_plan* plan, unsigned char* img, unsigned char* output_img, size_t count, int channels, int output_channels) {
+    if (plan->color == (COLOR_MATRIX | COLOR_GRAYSCALE)) {
+        unsigned char chunk[64 * 4];
+        for (size_t i = 0; i < count; i += 64) {
+            size_t n = (count - i < 64) ? count - i : 64;
+            color_matrix_row(img + i * channels, chunk, n, channels, &plan->matrix);
+            grayscale_row(chunk, output_img + i * output_channels, n, channels, output_channels, plan->gray_mode);
+        }
+    }
+    else if (plan->color == COLOR_GRAYSCALE) grayscale_row(img, output_img, count, channels, output_channels, plan->gray_mode);
+    else if (plan->color == COLOR_MATRIX) color_matrix_row(img, output_img, count, channels, &plan->matrix);
+    else memcpy(output_img, img, count * channels);
+}
+
+#ifdef SIMD_X86
+//pshufb masks reversing the pixel order of a 48 byte block (48 is a multiple of every channel count)
+//output vector r is the OR of each input vector q shuffled by REVERSE_MASKS[channels][r][q]
+unsigned char REVERSE_MASKS[5][3][3][16];
+//pshufb masks reversing the pixels within each 16 byte lane, for 1, 2 and 4 channels
+unsigned char REVERSE_LANE_MASKS[5][16];
+//vpermb indices reversing the pixels of a 64 byte block, or the first 48 bytes for 3 channels
+unsigned char REVERSE_INDEX[5][64];
+
+//byte of a block of block_size bytes that ends up at position j once its pixel order is reversed
+int reversed_byte(int j, int block_size, int channels) {
+    return (block_size / channels - 1 - j / channels) * channels + j % channels;
+}
+
+void build_reverse_masks(void) {
+    for (int channels = 1; channels <= 4; channels++) {
+        memset(REVERSE_MASKS[channels], 0x80, sizeof(REVERSE_MASKS[channels]));
+        for (int j = 0; j < 48; j++) {
+            int src = reversed_byte(j, 48, channels);
+            REVERSE_MASKS[channels][j / 16][src / 16][j % 16] = src % 16;
+        }
+        for (int j = 0; j < 16; j++) REVERSE_LANE_MASKS[channels][j] = (channels == 3) ? 0x80 : reversed_byte(j, 16, channels);
+        int block_size = (channels == 3) ? 48 : 64;
+        for (int j = 0; j < 64; j++) REVERSE_INDEX[channels][j] = (j < block_size) ? reversed_byte(j, block_size, channels) : j;
+    }
+}
+
+__attribute__((target("ssse3")))
+static inline void reverse48_ssse3(const unsigned char* src, __m128i out[3], int channels) {
+    __m128i in[3];
+    for (int q = 0; q < 3; q++) in[q] = _mm_loadu_si128((const __m128i*)(src + 16 * q));
+    for (int r = 0; r < 3; r++) {
+        //pixels never straddle vectors unless there are 3 channels
+        if (channels != 3) {
+            out[r] = _mm_shuffle_epi8(in[2 - r], _mm_loadu_si128((const __m128i*)REVERSE_MASKS[channels][r][2 - r]));
+            continue;
+        }
+        out[r] = _mm_setzero_si128();
+        for (int q = 0; q < 3; q++) {
+            out[r] = _mm_or_si128(out[r], _mm_shuffle_epi8(in[q], _mm_loadu_si128((const __m128i*)REVERSE_MASKS[3][r][q])));
+        }
+    }
+}
+
+//48 bytes at a time from the outside in, returns how many pixels were swapped
+__attribute__((target("ssse3")))
+size_t swap_reversed_ssse3(unsigned char* a, unsigned char* b, size_t count, int channels) {
+    size_t bytes = count * channels, i = 0;
+    for (; i + 48 <= bytes; i += 48) {
+        unsigned char* pa = a + i;
+        unsigned char* pb = b + bytes - i - 48;
+        __m128i ra[3], rb[3];
+        reverse48_ssse3(pa, ra, channels);
+        reverse48_ssse3(pb, rb, channels);
+        for (int r = 0; r < 3; r++) {
+            _mm_storeu_si128((__m128i*)(pa + 16 * r), rb[r]);
+            _mm_storeu_si128((__m128i*)(pb + 16 * r), ra[r]);
+        }
+    }
+    return i / channels;
+}
+
+//1, 2 and 4 channels, 32 bytes at a time: reverse pixels within each lane, then swap the lanes
+__attribute__((target("avx2")))
+size_t swap_reversed_avx2(unsigned char* a, unsigned char* b, size_t count, int channels) {
+    __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)REVERSE_LANE_MASKS[channels]));
+    size_t bytes = count * channels, i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        unsigned char* pa = a + i;
+        unsigned char* pb = b + bytes - i - 32;
+        __m256i ra = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)pa), mask), 0x4e);
+        __m256i rb = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)pb), mask), 0x4e);
+        _mm256_storeu_si256((__m256i*)pa, rb);
+        _mm256_storeu_si256((__m256i*)pb, ra);
+    }
+    return i / channels;
+}
+
+//every layout with one full width byte permute, 64 byte blocks (48 bytes through masked loads for 3 channels)
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+size_t swap_reversed_vbmi(unsigned char* a, unsigned char* b, size_t count, int channels) {
+    __m512i index = _mm512_loadu_si512(REVERSE_INDEX[channels]);
+    int block_size = (channels == 3) ? 48 : 64;
+    __mmask64 block_mask = (channels == 3) ? 0xffffffffffffULL : ~0ULL;
+    size_t bytes = count * channels, i = 0;
+    for (; i + block_size <= bytes; i += block_size) {
+        unsigned char* pa = a + i;
+        unsigned char* pb = b + bytes - i - block_size;
+        __m512i ra = _mm512_permutexvar_epi8(index, _mm512_maskz_loadu_epi8(block_mask, pa));
+        __m512i rb = _mm512_permutexvar_epi8(index, _mm512_maskz_loadu_epi8(block_mask, pb));
+        _mm512_mask_storeu_epi8(pa, block_mask, rb);
+        _mm512_mask_storeu_epi8(pb, block_mask, ra);
+    }
+    return i / channels;
+}
+#endif
+
+//swaps pixel i of a with pixel count-1-i of b, a and b must not overlap
+//reversing a span in place is swapping its first half with its mirrored second half
+void swap_reversed(unsigned char* a, unsigned char* b, size_t count, int channels) {
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (cpu_level >= CPU_AVX512VBMI) i = swap_reversed_vbmi(a, b, count, channels);
+    else if (cpu_level >= CPU_AVX2 && channels != 3) i = swap_reversed_avx2(a, b, count, channels);
+    else if (cpu_level >= CPU_SSSE3) i = swap_reversed_ssse3(a, b, count, channels);
+#endif
+    for (; i < count; i++) {
+        unsigned char* left = a + i * channels;
+        unsigned char* right = b + (count - 1 - i) * channels;
+        //go through existing channels
+        for (int c = 0; c < channels; c++) {
+            unsigned char tmp = left[c];
+            left[c] = right[c];
+            right[c] = tmp;
+        }
+    }
+}
+
+//swaps n bytes between a and b through a small stack buffer
+void swap_bytes(unsigned char* a, unsigned char* b, size_t n) {
+    unsigned char tmp[1024];
+    while (n > 0) {
+        size_t k = n < sizeof(tmp) ? n : sizeof(tmp);
+        memcpy(tmp, a, k);
+        memcpy(a, b, k);
+        memcpy(b, tmp, k);
+        a += k;
+        b += k;
+        n -= k;
+    }
+}
+
+//Iterate through each row and swap left and right values until meeting in the middle
+void hflip_in_place(unsigned char* img, int width, int height, int channels) {
+#pragma omp taskloop grainsize(tile_rows(width))
+    for (int y = 0; y < height; y++) {
+        unsigned char* row = img + (size_t)y * width * channels;
+        swap_reversed(row, row + (size_t)(width - width / 2) * channels, width / 2, channels);
+    }
+}
+
+//Swap top and bottom rows until meeting in the middle
+void vflip_in_place(unsigned char* img, int width, int height, int channels) {
+    size_t row_size = (size_t)width * channels;
+#pragma omp taskloop grainsize(tile_rows(width))
+    for (int y = 0; y < height / 2; y++) {
+        swap_bytes(img + y * row_size, img + (height - 1 - y) * row_size, row_size);
+    }
+}
+
+//180 degree rotation is the image's pixels in reverse order, so swap pixels from both ends until meeting in the middle
+void rotate180_in_place(unsigned char* img, int width, int height, int channels) {
+    size_t pixels = (size_t)width * height, half = pixels / 2;
+#pragma omp taskloop
+    for (size_t i = 0; i < half; i += TILE_PIXELS) {
+        size_t count = (half - i < TILE_PIXELS) ? half - i : TILE_PIXELS;
+        swap_reversed(img + i * channels, img + (pixels - i - count) * channels, count, channels);
+    }
+}
+
+
+//geometric operations as transform matrices (y points down)
+const int HFLIP_MATRIX[2][2] = { { -1, 0 }, { 0, 1 } };
+const int VFLIP_MATRIX[2][2] = { { 1, 0 }, { 0, -1 } };
+const int ROTATE90_MATRIX[2][2] = { { 0, -1 }, { 1, 0 } };
+const int ROTATE180_MATRIX[2][2] = { { -1, 0 }, { 0, -1 } };
+
+//applies op after the transforms already in t
+void transform_then(struct transform* t, const int op[2][2]) {
+    struct transform r;
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            r.m[i][j] = op[i][0] * t->m[0][j] + op[i][1] * t->m[1][j];
+        }
+    }
+    *t = r;
+}
+
+//composes the selected flips and rotation into one transform, an --ops chain already is one
+void plan_transform(struct transform* t, const struct operations* ops) {
+    if (ops->ordered) {
+        *t = ops->transform;
+        return;
+    }
+    *t = (struct transform){ { { 1, 0 }, { 0, 1 } } };
+    if (ops->hflip) transform_then(t, HFLIP_MATRIX);
+    if (ops->vflip) transform_then(t, VFLIP_MATRIX);
+    if (ops->rotate) {
+        for (int r = 0; r < ops->rotation; r += 90) transform_then(t, ROTATE90_MATRIX);
+    }
+}
+
+int transform_is(const struct transform* t, const int op[2][2]) {
+    return memcmp(t->m, op, sizeof(t->m)) == 0;
+}
+
+int transform_is_identity(const struct transform* t) {
+    return transform_is(t, (const int[2][2]){ { 1, 0 }, { 0, 1 } });
+}
+
+//multiplies the selected color matrix operations into one matrix, an --ops chain already is one
+void plan_color_matrix(struct color_matrix* m, const struct operations* ops) {
+    if (ops->ordered) {
+        *m = ops->matrix;
+        return;
+    }
+    *m = IDENTITY_COLOR_MATRIX;
+    if (ops->sepia) color_matrix_then(m, &SEPIA_MATRIX);
+    if (ops->swap) color_matrix_then(m, &SWAP_MATRIX);
+    if (ops->saturation != 1) {
+        struct color_matrix op = saturation_matrix(ops->saturation);
+        color_matrix_then(m, &op);
+    }
+    if (ops->hue != 0) {
+        struct color_matrix op = hue_matrix(ops->hue);
+        color_matrix_then(m, &op);
+    }
+    if (ops->tint) {
+        struct color_matrix op = tint_matrix(ops->tint_color);
+        color_matrix_then(m, &op);
+    }
+    if (ops->brightness != 0) {
+        struct color_matrix op = brightness_matrix(ops->brightness);
+        color_matrix_then(m, &op);
+    }
+}
+
+//flips and 180 degree rotation can overwrite their source, other transforms need a separate destination
+int transform_in_place(const struct transform* t) {
+    return transform_is_identity(t) || transform_is(t, HFLIP_MATRIX) || transform_is(t, VFLIP_MATRIX) || transform_is(t, ROTATE180_MATRIX);
+}
+
+void apply_transform_in_place(unsigned char* img, int width, int height, int channels, const struct transform* t) {
+    if (transform_is(t, HFLIP_MATRIX)) hflip_in_place(img, width, height, channels);
+    else if (transform_is(t, VFLIP_MATRIX)) vflip_in_place(img, width, height, channels);
+    else if (transform_is(t, ROTATE180_MATRIX)) rotate180_in_place(img, width, height, channels);
+}
+
+//color operations only apply to rgb(a) images
+void plan_operations(struct process_plan* plan, const struct operations* ops, int channels) {
+    plan->color = COLOR_NONE;
+    plan->gray_mode = ops->gray_mode;
+    if (channels >= 3) {
+        struct color_matrix m;
+        plan_color_matrix(&m, ops);
+        fix_color_matrix(&plan->matrix, &m);
+        //a chain that cancels out (e.g. swap twice) rounds back to the identity and is skipped
+        struct fixed_matrix identity;
+        fix_color_matrix(&identity, &IDENTITY_COLOR_MATRIX);
+        if (memcmp(&plan->matrix, &identity, sizeof(identity)) != 0) plan->color |= COLOR_MATRIX;
+        if (ops->greyscale) plan->color |= COLOR_GRAYSCALE;
+    }
+    plan_transform(&plan->transform, ops);
+}
+
+//90 and 270 degree rotations (and transposes) swap width and height
+int transform_swaps_axes(const struct transform* t) {
+    return t->m[0][0] == 0;
+}
+
+//copies count pixels taken step bytes apart in src to consecutive pixels in dst
+//constant sized copies per channel count so the inner loop compiles to plain moves
+void gather_pixels(unsigned char* dst, unsigned char* src, ptrdiff_t step, int count, int channels) {
+    switch (channels) {
+    case 1: for (int x = 0; x < count; x++, dst += 1, src += step) dst[0] = src[0]; break;
+    case 2: for (int x = 0; x < count; x++, dst += 2, src += step) memcpy(dst, src, 2); break;
+    case 3: for (int x = 0; x < count; x++, dst += 3, src += step) memcpy(dst, src, 3); break;
+    default: for (int x = 0; x < count; x++, dst += 4, src += step) memcpy(dst, src, 4); break;
+    }
+}
+
+#ifdef SIMD_X86
+//SIMD transposes copy a strip of n destination rows through registers, in blocks of n x n pixels. For
+//transforms that swap axes, destination pixel x of the strip comes from source line x (step_x apart) and
+//destination row j from pixel j of that line (step_y apart, backwards when step_y < 0). Each source line
+//of a block is one vector load, and after the transpose vector j holds the block's pixels of row j.
+//Kernels return how many pixels of each row they did, the rest are left to gather_pixels.
+
+//fills rows with the destination row each transposed vector goes to, and returns the first source line
+//moved to the lowest address pixel the strip reads from it
+static inline const unsigned char* strip_rows(unsigned char* rows[8], unsigned char* dst, size_t dst_stride,
+    const unsigned char* src, ptrdiff_t step_y, int n) {
+    for (int j = 0; j < n; j++) rows[j] = dst + (step_y < 0 ? n - 1 - j : j) * dst_stride;
+    return (step_y < 0) ? src + (n - 1) * step_y : src;
+}
+
+//1 channel, 8x8 pixel blocks
+__attribute__((target("sse2")))
+int transpose8_1_sse2(unsigned char* dst, size_t dst_stride, const unsigned char* src, ptrdiff_t step_x, ptrdiff_t step_y, int count) {
+    unsigned char* rows[8];
+    src = strip_rows(rows, dst, dst_stride, src, step_y, 8);
+    int x = 0;
+    for (; x + 8 <= count; x += 8, src += 8 * step_x) {
+        __m128i a[8], t[4], u[4];
+        for (int k = 0; k < 8; k++) a[k] = _mm_loadl_epi64((const __m128i*)(src + k * step_x));
+        for (int k = 0; k < 4; k++) t[k] = _mm_unpacklo_epi8(a[2 * k], a[2 * k + 1]);
+        u[0] = _mm_unpacklo_epi16(t[0], t[1]);
+        u[1] = _mm_unpackhi_epi16(t[0], t[1]);
+        u[2] = _mm_unpacklo_epi16(t[2], t[3]);
+        u[3] = _mm_unpackhi_epi16(t[2], t[3]);
+        //each result holds two destination rows
+        for (int k = 0; k < 4; k++) {
+            __m128i v = (k & 1) ? _mm_unpackhi_epi32(u[k / 2], u[k / 2 + 2]) : _mm_unpacklo_epi32(u[k / 2], u[k / 2 + 2]);
+            _mm_storel_epi64((__m128i*)(rows[2 * k] + x), v);
+            _mm_storel_epi64((__m128i*)(rows[2 * k + 1] + x), _mm_srli_si128(v, 8));
+        }
+    }
+    return x;
+}
+
+//2 channels, 8x8 pixel blocks
+__attribute__((target("sse2")))
+int transpose8_2_sse2(unsigned char* dst, size_t dst_stride, const unsigned char* src, ptrdiff_t step_x, ptrdiff_t step_y, int count) {
+    unsigned char* rows[8];
+    src = strip_rows(rows, dst, dst_stride, src, step_y, 8);
+    int x = 0;
+    for (; x + 8 <= count; x += 8, src += 8 * step_x) {
+        __m128i a[8], t[8], u[8];
+        for (int k = 0; k < 8; k++) a[k] = _mm_loadu_si128((const __m128i*)(src + k * step_x));
+        for (int k = 0; k < 4; k++) {
+            t[2 * k] = _mm_unpacklo_epi16(a[2 * k], a[2 * k + 1]);
+            t[2 * k + 1] = _mm_unpackhi_epi16(a[2 * k], a[2 * k + 1]);
+        }
+        //u[0..3] hold pixels 0-1, 2-3, 4-5, 6-7 of lines 0-3, u[4..7] the same of lines 4-7
+        for (int h = 0; h < 2; h++) {
+            u[4 * h + 0] = _mm_unpacklo_epi32(t[4 * h], t[4 * h + 2]);
+            u[4 * h + 1] = _mm_unpackhi_epi32(t[4 * h], t[4 * h + 2]);
+            u[4 * h + 2] = _mm_unpacklo_epi32(t[4 * h + 1], t[4 * h + 3]);
+            u[4 * h + 3] = _mm_unpackhi_epi32(t[4 * h + 1], t[4 * h + 3]);
+        }
+        for (int k = 0; k < 4; k++) {
+            _mm_storeu_si128((__m128i*)(rows[2 * k] + x * 2), _mm_unpacklo_epi64(u[k], u[k + 4]));
+            _mm_storeu_si128((__m128i*)(rows[2 * k + 1] + x * 2), _mm_unpackhi_epi64(u[k], u[k + 4]));
+        }
+    }
+    return x;
+}
+
+__attribute__((target("sse2")))
+static inline void transpose4x4_epi32_sse2(__m128i a[4]) {
+    __m128i t0 = _mm_unpacklo_epi32(a[0], a[1]), t1 = _mm_unpackhi_epi32(a[0], a[1]);
+    __m128i t2 = _mm_unpacklo_epi32(a[2], a[3]), t3 = _mm_unpackhi_epi32(a[2], a[3]);
+    a[0] = _mm_unpacklo_epi64(t0, t2);
+    a[1] = _mm_unpackhi_epi64(t0, t2);
+    a[2] = _mm_unpacklo_epi64(t1, t3);
+    a[3] = _mm_unpackhi_epi64(t1, t3);
+}
+
+//4 channels, 4x4 pixel blocks
+__attribute__((target("sse2")))
+int transpose4_4_sse2(unsigned char* dst, size_t dst_stride, const unsigned char* src, ptrdiff_t step_x, ptrdiff_t step_y, int count) {
+    unsigned char* rows[8];
+    src = strip_rows(rows, dst, dst_stride, src, step_y, 4);
+    int x = 0;
+    for (; x + 4 <= count; x += 4, src += 4 * step_x) {
+        __m128i a[4];
+        for (int k = 0; k < 4; k++) a[k] = _mm_loadu_si128((const __m128i*)(src + k * step_x));
+        transpose4x4_epi32_sse2(a);
+        for (int j = 0; j < 4; j++) _mm_storeu_si128((__m128i*)(rows[j] + x * 4), a[j]);
+    }
+    return x;
+}
+
+//3 channels, 4x4 pixel blocks, each pixel is spread to a 32-bit lane for the transpose
+//lines are read as exactly 12 bytes, so the last line of the image is never read past
+__attribute__((target("ssse3")))
+int transpose4_3_ssse3(unsigned char* dst, size_t dst_stride, const unsigned char* src, ptrdiff_t step_x, ptrdiff_t step_y, int count) {
+    __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    unsigned char* rows[8];
+    src = strip_rows(rows, dst, dst_stride, src, step_y, 4);
+    int x = 0;
+    for (; x + 4 <= count; x += 4, src += 4 * step_x) {
+        __m128i a[4];
+        for (int k = 0; k < 4; k++) {
+            const unsigned char* p = src + k * step_x;
+            int tail;
+            memcpy(&tail, p + 8, 4);
+            a[k] = _mm_shuffle_epi8(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)p), _mm_cvtsi32_si128(tail)), spread);
+        }
+        transpose4x4_epi32_sse2(a);
+        for (int j = 0; j < 4; j++) store_rgb4_ssse3(rows[j] + x * 3, a[j]);
+    }
+    return x;
+}
+#endif
+
+//rows per SIMD transpose strip for this channel count, 0 if there is no kernel at this cpu level
+int transpose_strip_rows(int channels) {
+#ifdef SIMD_X86
+    if (channels == 3) return (cpu_level >= CPU_SSSE3) ? 4 : 0;
+    if (cpu_level >= CPU_SSE2) return (channels == 4) ? 4 : 8;
+#endif
+    return 0;
+}
+
+//transposes count pixels of each of transpose_strip_rows(channels) destination rows, returns how many were done
+int transpose_strip(unsigned char* dst, size_t dst_stride, const unsigned char* src, ptrdiff_t step_x, ptrdiff_t step_y, int count, int channels) {
+#ifdef SIMD_X86
+    switch (channels) {
+    case 1: return transpose8_1_sse2(dst, dst_stride, src, step_x, step_y, count);
+    case 2: return transpose8_2_sse2(dst, dst_stride, src, step_x, step_y, count);
+    case 3: return transpose4_3_ssse3(dst, dst_stride, src, step_x, step_y, count);
+    default: return transpose4_4_sse2(dst, dst_stride, src, step_x, step_y, count);
+    }
+#endif
+    return 0;
+}
+
+//tile side so a source and a destination tile fit in L1 together, a multiple of 8 pixels
+int transpose_tile(int channels) {
+    if (TRANSPOSE_TILE > 0) return TRANSPOSE_TILE;
+    int tile = 8;
+    while (2L * (tile + 8) * (tile + 8) * channels <= l1_cache_size) tile += 8;
+    return tile;
+}
+
+//Copies img into output_img with a transform that swaps axes (90/270 rotation, transposes) and no color operation
+//The destination is written directly in L1 sized tiles, and each tile in SIMD transposed strips where possible
+void apply_transpose(unsigned char* img, unsigned char* output_img, int width, int height, int channels, const struct transform* t) {
+    int out_width = height, out_height = width;
+    ptrdiff_t stride = (ptrdiff_t)width * channels;
+    size_t out_stride = (size_t)out_width * channels;
+
+    //source steps for one destination pixel right and one destination row down
+    ptrdiff_t step_x = t->m[0][1] * stride;
+    ptrdiff_t step_y = t->m[1][0] * channels;
+    int src_x = (t->m[1][0] < 0) ? width - 1 : 0;
+    int src_y = (t->m[0][1] < 0) ? height - 1 : 0;
+    unsigned char* origin = img + src_y * stride + (ptrdiff_t)src_x * channels;
+
+    int tile = transpose_tile(channels);
+    int strip = transpose_strip_rows(channels);
+    int tile_grain = tile_rows(out_width) / tile;
+#pragma omp taskloop grainsize(tile_grain > 0 ? tile_grain : 1)
+    for (int tile_y = 0; tile_y < out_height; tile_y += tile) {
+        for (int tile_x = 0; tile_x < out_width; tile_x += tile) {
+            int y_end = (tile_y + tile < out_height) ? tile_y + tile : out_height;
+            int x_end = (tile_x + tile < out_width) ? tile_x + tile : out_width;
+
+            int y = tile_y;
+            //whole strips, with the pixels right of the strip's last block gathered one row at a time
+            for (; strip && y + strip <= y_end; y += strip) {
+                int x = tile_x + transpose_strip(output_img + y * out_stride + (size_t)tile_x * channels, out_stride,
+                    origin + y * step_y + tile_x * step_x, step_x, step_y, x_end - tile_x, channels);
+                for (int r = y; r < y + strip && x < x_end; r++) {
+                    gather_pixels(output_img + r * out_stride + (size_t)x * channels, origin + r * step_y + x * step_x, step_x, x_end - x, channels);
+                }
+            }
+            for (; y < y_end; y++) {
+                gather_pixels(output_img + y * out_stride + (size_t)tile_x * channels, origin + y * step_y + tile_x * step_x, step_x, x_end - tile_x, channels);
+            }
+        }
+    }
+}
+
+//Copies img into output_img with the transform and color operation applied, in one pass over destination tiles
+//Each destination row walks the source along a fixed step, so no intermediate image buffers are needed
+//output_img may only be img for a color matrix with the identity transform
+void apply_transform(unsigned char* img, unsigned char* output_img, int width, int height, int channels, int output_channels,
+    const struct process_plan* plan) {
+    const struct transform* t = &plan->transform;
+    if (plan->color == COLOR_NONE && transform_swaps_axes(t)) {
+        apply_transpose(img, output_img, width, height, channels, t);
+        return;
+    }
+    int out_width = transform_swaps_axes(t) ? height : width;
+    int out_height = transform_swaps_axes(t) ? width : height;
+    ptrdiff_t stride = (ptrdiff_t)width * channels;
+
+    //source steps for one destination pixel right and one destination row down
+    ptrdiff_t step_x = t->m[0][0] * channels + t->m[0][1] * stride;
+    ptrdiff_t step_y = t->m[1][0] * channels + t->m[1][1] * stride;
+    //destination's top left pixel comes from whichever source corner the transform moves there
+    int src_x = (t->m[0][0] < 0 || t->m[1][0] < 0) ? width - 1 : 0;
+    int src_y = (t->m[0][1] < 0 || t->m[1][1] < 0) ? height - 1 : 0;
+    unsigned char* origin = img + src_y * stride + (ptrdiff_t)src_x * channels;
+
+    // Tile based so transposing transforms read the source within cache sized blocks
+    //transforms keeping rows contiguous (identity, vflip) go a whole row at a time
+    const int TILE_SIZE = 64;
+    int tile_width = (step_x == channels) ? out_width : TILE_SIZE;
+    int tile_grain = tile_rows(out_width) / TILE_SIZE;
+#pragma omp taskloop grainsize(tile_grain > 0 ? tile_grain : 1)
+    for (int tile_y = 0; tile_y < out_height; tile_y += TILE_SIZE) {
+        for (int tile_x = 0; tile_x < out_width; tile_x += tile_width) {
+            int y_end = (tile_y + TILE_SIZE < out_height) ? tile_y + TILE_SIZE : out_height;
+            int x_end = (tile_x + tile_width < out_width) ? tile_x + tile_width : out_width;
+
+            for (int y = tile_y; y < y_end; y++) {
+                unsigned char* dst = output_img + ((size_t)y * out_width + tile_x) * output_channels;
+                unsigned char* src = origin + y * step_y + tile_x * step_x;
+                if (plan->color == COLOR_NONE) {
+                    gather_pixels(dst, src, step_x, x_end - tile_x, channels);
+                    continue;
+                }
+                //source row segment is contiguous when the transform keeps x direction, otherwise gather
+                //the tile row into a small cache resident buffer and apply the color operation from there
+                unsigned char row[64 * 4]; //TILE_SIZE pixels of up to 4 channels
+                if (step_x != channels) {
+                    gather_pixels(row, src, step_x, x_end - tile_x, channels);
+                    src = row;
+                }
+                color_row(plan, src, dst, x_end - tile_x, channels, output_channels);
+            }
+        }
+    }
+}
+
+
+//output file encoded in memory by stbi_write_*_to_func
+struct encoded {
+    unsigned char* data;
+    size_t size, capacity;
+    int failed; //a buffer couldn't be grown, data is incomplete
+};
+
+#ifdef HAVE_IO_URING
+struct uring;
+void uring_free(void* ring);
+#endif
+
+//per thread resources, set up on first use and freed when the thread exits
+struct thread_state {
+    struct encoded output; //encode buffer reused for every image the thread writes
+    struct uring* ring;
+    int ring_failed; //io_uring setup or a submission failed, it isn't tried again
+    struct arena* arena; //where arena_malloc allocates, set while the thread decodes or encodes an image
+    void* pool_cache[POOL_CLASSES]; //a free buffer of each size class, taken before the shared pool
+};
+
+//buffer pool for image sized buffers (processed images, read-ahead files, large decoder buffers and arena chunks):
+//freed buffers are kept by size class and handed out again, instead of glibc mapping and unmapping every
+//multi-megabyte buffer and the kernel zero filling its pages again on first touch. Classes are powers of two
+//from POOL_MIN_SIZE, each buffer a separate mapping. Each thread keeps one free buffer per class, the rest go to
+//a shared list, and buffers freed while the thread caches and shared lists hold POOL_BYTES are unmapped
+struct pool_buffer {
+    struct pool_buffer* next;
+};
+
+struct buffer_pool {
+    struct pool_buffer* idle[POOL_CLASSES];
+    size_t idle_bytes; //in the shared lists and the thread caches, updated atomically
+    size_t mapped_bytes, peak_bytes;
+    long hits, misses;
+    pthread_mutex_t lock;
+};
+struct buffer_pool pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//size class holding size bytes
+int pool_class(size_t size) {
+    int c = 0;
+    while (c < POOL_CLASSES - 1 && ((size_t)POOL_MIN_SIZE << c) < size) c++;
+    return c;
+}
+
+//bytes actually available in a pool buffer of size bytes
+size_t pool_size(size_t size) {
+    return (size_t)POOL_MIN_SIZE << pool_class(size);
+}
+
+//hands an exiting thread's cached buffers to the shared lists, they are already counted as idle
+void pool_release_cache(struct thread_state* t) {
+    pthread_mutex_lock(&pool.lock);
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        struct pool_buffer* b = t->pool_cache[c];
+        if (!b) continue;
+        b->next = pool.idle[c];
+        pool.idle[c] = b;
+        t->pool_cache[c] = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+pthread_key_t state_key;
+pthread_once_t state_key_once = PTHREAD_ONCE_INIT;
+
+void free_thread_state(void* state) {
+    struct thread_state* t = state;
+    pool_release_cache(t);
+    free(t->output.data);
+#ifdef HAVE_IO_URING
+    if (t->ring) uring_free(t->ring);
+#endif
+    free(t);
+}
+
+void create_state_key(void) {
+    pthread_key_create(&state_key, free_thread_state);
+}
+
+//the calling thread's resources
+struct thread_state* thread_state(void) {
+    pthread_once(&state_key_once, create_state_key);
+    struct thread_state* t = pthread_getspecific(state_key);
+    if (!t) {
+        t = calloc(1, sizeof(struct thread_state));
+        pthread_setspecific(state_key, t);
+    }
+    return t;
+}
+
+//a buffer of at least size bytes, NULL if it can't be mapped
+void* pool_alloc(size_t size) {
+    int c = pool_class(size);
+    size_t bytes = (size_t)POOL_MIN_SIZE << c;
+    struct thread_state* t = thread_state();
+    void* p = t->pool_cache[c];
+    if (p) t->pool_cache[c] = NULL;
+    else {
+        pthread_mutex_lock(&pool.lock);
+        struct pool_buffer* b = pool.idle[c];
+        if (b) pool.idle[c] = b->next;
+        pthread_mutex_unlock(&pool.lock);
+        p = b;
+    }
+    if (p) {
+#pragma omp atomic
+        pool.idle_bytes -= bytes;
+#pragma omp atomic
+        pool.hits++;
+        return p;
+    }
+
+#ifdef MADV_HUGEPAGE
+    //huge pages only back the 2 MB aligned parts of a mapping, so the mapping is made 2 MB larger and trimmed
+    //to an aligned start (the classes from 2 MB up are multiples of 2 MB, so the end is aligned as well)
+    const size_t huge = 2 * 1024 * 1024;
+    if (settings.huge_pages && bytes >= huge) {
+        unsigned char* m = mmap(NULL, bytes + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) return NULL;
+        size_t head = (huge - (uintptr_t)m % huge) % huge;
+        if (head > 0) munmap(m, head);
+        munmap(m + head + bytes, huge - head);
+        p = m + head;
+        madvise(p, bytes, MADV_HUGEPAGE);
+    }
+    else
+#endif
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    pthread_mutex_lock(&pool.lock);
+    pool.misses++;
+    pool.mapped_bytes += bytes;
+    if (pool.mapped_bytes > pool.peak_bytes) pool.peak_bytes = pool.mapped_bytes;
+    pthread_mutex_unlock(&pool.lock);
+    return p;
+}
+
+//returns a buffer from pool_alloc, size is the size it was allocated with
+void pool_free(void* p, size_t size) {
+    if (!p) return;
+    int c = pool_class(size);
+    size_t bytes = (size_t)POOL_MIN_SIZE << c;
+    //the buffer is counted as idle first, so threads freeing at the same time can't together go over POOL_BYTES
+    size_t idle;
+#pragma omp atomic capture
+    idle = pool.idle_bytes += bytes;
+    if (idle > POOL_BYTES) {
+#pragma omp atomic
+        pool.idle_bytes -= bytes;
+        pthread_mutex_lock(&pool.lock);
+        pool.mapped_bytes -= bytes;
+        pthread_mutex_unlock(&pool.lock);
+        munmap(p, bytes);
+        return;
+    }
+    struct thread_state* t = thread_state();
+    if (!t->pool_cache[c]) {
+        t->pool_cache[c] = p;
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    struct pool_buffer* b = p;
+    b->next = pool.idle[c];
+    pool.idle[c] = b;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+//run summary line for the pool
+void print_pool_stats(void) {
+    long requests = pool.hits + pool.misses;
+    printf("Buffer pool: %ld of %ld buffers reused (%.1f%%), %.1f MB mapped at peak\n", pool.hits, requests,
+        requests > 0 ? 100.0 * pool.hits / requests : 0.0, pool.peak_bytes / (1024.0 * 1024.0));
+}
+
+//picks the buffer an operation writes its out_width x out_height x out_channels result into
+//dst->pixels left NULL (or set to src->pixels) lets the operation choose: src itself when it can work in place,
+//otherwise a new buffer from the buffer pool that the caller takes ownership of (and returns with pool_free).
+//Any other dst->pixels is written out of place
+//returns 0 if a new buffer could not be allocated
+int prepare_output(const struct image_buffer* src, struct image_buffer* dst, int out_width, int out_height, int out_channels, int in_place) {
+    int open_choice = (dst->pixels == NULL || dst->pixels == src->pixels);
+    dst->width = out_width;
+    dst->height = out_height;
+    dst->channels = out_channels;
+    if (open_choice && in_place) dst->pixels = src->pixels;
+    else if (open_choice) dst->pixels = pool_alloc((size_t)out_width * out_height * out_channels);
+    if (!dst->pixels) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 0;
+    }
+    return 1;
+}
+
+//Applies the plan's color operation and transform from src to dst, in place, out of place or into a new buffer (see prepare_output)
+//plain flips, 180 degree rotation and a color matrix alone work in place, everything else needs a second buffer
+int apply_plan(const struct process_plan* plan, const struct image_buffer* src, struct image_buffer* dst) {
+    const struct transform* t = &plan->transform;
+    int swaps = transform_swaps_axes(t);
+    int out_channels = (plan->color & COLOR_GRAYSCALE) ? ((src->channels == 4) ? 2 : 1) : src->channels;
+    int in_place = (plan->color == COLOR_NONE && transform_in_place(t)) || (plan->color == COLOR_MATRIX && transform_is_identity(t));
+    if (!prepare_output(src, dst, swaps ? src->height : src->width, swaps ? src->width : src->height, out_channels, in_place)) return 0;
+
+    if (dst->pixels != src->pixels) apply_transform(src->pixels, dst->pixels, src->width, src->height, src->channels, out_channels, plan);
+    else if (plan->color == COLOR_NONE) apply_transform_in_place(src->pixels, src->width, src->height, src->channels, t);
+    else apply_transform(src->pixels, src->pixels, src->width, src->height, src->channels, src->channels, plan);
+    return 1;
+}
+
+//single operations, each takes the same src / dst buffers as apply_plan
+
+//Grayscale operation takes average of rgb values into a single channel
+int apply_grayscale(const struct image_buffer* src, struct image_buffer* dst, int gray_mode) {
+    struct operations ops = { .greyscale = 1, .gray_mode = gray_mode, .saturation = 1 };
+    struct process_plan plan;
+    plan_operations(&plan, &ops, src->channels);
+    return apply_plan(&plan, src, dst);
+}
+
+//Apply color matrix to rgb values
+int apply_color_matrix(const struct image_buffer* src, struct image_buffer* dst, const struct color_matrix* m) {
+    struct process_plan plan = { .color = (src->channels >= 3) ? COLOR_MATRIX : COLOR_NONE, .transform = { { { 1, 0 }, { 0, 1 } } } };
+    fix_color_matrix(&plan.matrix, m);
+    return apply_plan(&plan, src, dst);
+}
+
+//Apply sepia coefficients to rgb values
+int apply_sepia(const struct image_buffer* src, struct image_buffer* dst) {
+    return apply_color_matrix(src, dst, &SEPIA_MATRIX);
+}
+
+//plan for a single geometric operation
+struct process_plan transform_plan(const int op[2][2]) {
+    struct process_plan plan = { .color = COLOR_NONE, .transform = { { { 1, 0 }, { 0, 1 } } } };
+    transform_then(&plan.transform, op);
+    return plan;
+}
+
+int apply_hflip(const struct image_buffer* src, struct image_buffer* dst) {
+    struct process_plan plan = transform_plan(HFLIP_MATRIX);
+    return apply_plan(&plan, src, dst);
+}
+
+int apply_vflip(const struct image_buffer* src, struct image_buffer* dst) {
+    struct process_plan plan = transform_plan(VFLIP_MATRIX);
+    return apply_plan(&plan, src, dst);
+}
+
+//Rotates image by 90, 180 or 270 degrees (180 in place, 90 and 270 into a new buffer or dst)
+int apply_rotate(const struct image_buffer* src, struct image_buffer* dst, int rotation) {
+    if (rotation != 90 && rotation != 180 && rotation != 270) {
+        fprintf(stderr, "ERROR: Invalid rotation value (%d). Valid values are 90, 180, 270\n", rotation);
+        return 0;
+    }
+    struct process_plan plan = transform_plan(ROTATE90_MATRIX);
+    for (int r = 90; r < rotation; r += 90) transform_then(&plan.transform, ROTATE90_MATRIX);
+    return apply_plan(&plan, src, dst);
+}
+
+void queue_init(struct job_queue* q, int capacity, int producers) {
+    q->items = malloc(capacity * sizeof(struct image_job*));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->producers = producers;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+void queue_destroy(struct job_queue* q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+}
+
+//blocks while the queue is full
+void queue_push(struct job_queue* q, struct image_job* job) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity) pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % q->capacity] = job;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+//blocks while the queue is empty, returns NULL once every producer is done and the queue is drained
+struct image_job* queue_pop(struct job_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0) pthread_cond_wait(&q->not_empty, &q->lock);
+    struct image_job* job = NULL;
+    if (q->count > 0) {
+        job = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+//called by each producer when it has no more images, wakes consumers once the last one finishes
+void queue_producer_done(struct job_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    if (--q->producers == 0) pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+//creates the folders leading up to a file path (images found in input subfolders keep their relative path)
+void make_parent_folders(const char* path) {
+    char folder[PATH_MAX];
+    for (const char* slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        size_t n = slash - path;
+        if (n >= sizeof(folder)) return;
+        memcpy(folder, path, n);
+        folder[n] = '\0';
+        if (mkdir(folder, 0777) != 0 && errno != EEXIST) return;
+    }
+}
+
+//frees the job's current image buffer
+void release_image(struct image_job* job) {
+    struct image_buffer* image = &job->image;
+    if (job->from_stbi) stbi_image_free(image->pixels);
+    else pool_free(image->pixels, (size_t)image->width * image->height * image->channels);
+    image->pixels = NULL;
+}
+
+//decodes a file straight from a read only mapping of it, so the decoder parses page cache pages instead of
+//copying them through small stdio reads. The mapping is read front to back, which MADV_SEQUENTIAL tells the
+//kernel so it reads ahead aggressively, and MADV_WILLNEED starts that readahead before decoding begins.
+//Files that can't be mapped, or are larger than stbi_load_from_memory's int length, go through stbi_load
+unsigned char* load_mapped(const char* path, int* width, int* height, int* channels) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0 && info.st_size <= INT_MAX) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return stbi_load(path, width, height, channels, 0);
+
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+    madvise(data, info.st_size, MADV_WILLNEED);
+    unsigned char* img = stbi_load_from_memory(data, (int)info.st_size, width, height, channels, 0);
+    munmap(data, info.st_size);
+    return img;
+}
+
+//makes room for size more bytes after out's data, returns where they go or NULL (marking out failed) if it can't grow
+unsigned char* encoded_reserve(struct encoded* out, size_t size) {
+    if (out->failed) return NULL;
+    if (out->size + size > out->capacity) {
+        size_t capacity = out->capacity > 0 ? out->capacity * 2 : 64 * 1024;
+        while (capacity < out->size + size) capacity *= 2;
+        unsigned char* grown = realloc(out->data, capacity);
+        if (!grown) {
+            out->failed = 1;
+            return NULL;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+    return out->data + out->size;
+}
+
+//stbi_write_func appending to a struct encoded
+void encoded_append(void* context, void* data, int size) {
+    struct encoded* out = context;
+    unsigned char* dst = encoded_reserve(out, size);
+    if (!dst) return;
+    memcpy(dst, data, size);
+    out->size += size;
+}
+
+//deflate length and distance codes: base value and extra bits of each symbol
+const unsigned short DEFLATE_LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const unsigned char DEFLATE_LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+    5, 5, 5, 5, 0 };
+const unsigned short DEFLATE_DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+    769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const unsigned char DEFLATE_DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+    11, 11, 12, 12, 13, 13 };
+
+//huffman codes of a block, bit reversed for the lsb first bit order, and their lengths
+struct deflate_codes {
+    unsigned short litlen[288][2];
+    unsigned short dist[30][2];
+};
+
+//lookup tables built once: the fixed huffman codes, and the code of each match length (3-258) and distance (1-256
+//directly, larger ones by (distance - 1) >> 7)
+struct deflate_codes fixed_codes;
+unsigned char length_codes[259], dist_codes_small[256], dist_codes_large[256];
+pthread_once_t deflate_tables_once = PTHREAD_ONCE_INIT;
+
+int reverse_bits(int code, int length) {
+    int r = 0;
+    for (int i = 0; i < length; i++, code >>= 1) r = (r << 1) | (code & 1);
+    return r;
+}
+
+void build_deflate_tables(void) {
+    for (int n = 0; n < 288; n++) {
+        int code = n <= 143 ? 0x30 + n : n <= 255 ? 0x190 + n - 144 : n <= 279 ? n - 256 : 0xc0 + n - 280;
+        int length = n <= 143 ? 8 : n <= 255 ? 9 : n <= 279 ? 7 : 8;
+        fixed_codes.litlen[n][0] = reverse_bits(code, length);
+        fixed_codes.litlen[n][1] = length;
+    }
+    for (int n = 0; n < 30; n++) {
+        fixed_codes.dist[n][0] = reverse_bits(n, 5);
+        fixed_codes.dist[n][1] = 5;
+    }
+    for (int code = 0, length = 3; length <= 258; length++) {
+        while (code < 28 && length >= DEFLATE_LENGTH_BASE[code + 1]) code++;
+        length_codes[length] = code;
+    }
+    for (int code = 0, d = 1; d <= 32768; d++) {
+        while (code < 29 && d >= DEFLATE_DIST_BASE[code + 1]) code++;
+        if (d <= 256) dist_codes_small[d - 1] = code;
+        else dist_codes_large[(d - 1) >> 7] = code;
+    }
+}
+
+static inline int dist_code(int distance) {
+    return distance <= 256 ? dist_codes_small[distance - 1] : dist_codes_large[(distance - 1) >> 7];
+}
+
+//lsb first bit writer for deflate streams, writes 4 bytes at a time into a buffer reserved up front
+struct deflate_writer {
+    unsigned char* p;
+    unsigned long long bits;
+    int count;
+};
+
+static inline void deflate_put(struct deflate_writer* w, unsigned value, int length) {
+    w->bits |= (unsigned long long)value << w->count;
+    w->count += length;
+    if (w->count >= 32) {
+        for (int i = 0; i < 4; i++) *w->p++ = (unsigned char)(w->bits >> (8 * i));
+        w->bits >>= 32;
+        w->count -= 32;
+    }
+}
+
+//writes out the bits left, padded with 0 bits to a byte boundary
+void deflate_align(struct deflate_writer* w) {
+    for (; w->count > 0; w->count -= 8) {
+        *w->p++ = (unsigned char)w->bits;
+        w->bits >>= 8;
+    }
+    w->count = 0;
+    w->bits = 0;
+}
+
+static inline void deflate_literal(struct deflate_writer* w, const struct deflate_codes* codes, int c) {
+    deflate_put(w, codes->litlen[c][0], codes->litlen[c][1]);
+}
+
+static inline void deflate_match(struct deflate_writer* w, const struct deflate_codes* codes, int length, int distance) {
+    int code = length_codes[length];
+    deflate_put(w, codes->litlen[257 + code][0], codes->litlen[257 + code][1]);
+    if (DEFLATE_LENGTH_EXTRA[code]) deflate_put(w, length - DEFLATE_LENGTH_BASE[code], DEFLATE_LENGTH_EXTRA[code]);
+    code = dist_code(distance);
+    deflate_put(w, codes->dist[code][0], codes->dist[code][1]);
+    if (DEFLATE_DIST_EXTRA[code]) deflate_put(w, distance - DEFLATE_DIST_BASE[code], DEFLATE_DIST_EXTRA[code]);
+}
+
+//crc-32 lookup tables for slicing by 8: png_crc32_tables[k][b] is the crc of byte b followed by k zero bytes, so 8 bytes
+//are folded into the crc with 8 independent lookups
+unsigned png_crc32_tables[8][256];
+pthread_once_t png_crc32_tables_once = PTHREAD_ONCE_INIT;
+
+void build_png_crc32_tables(void) {
+    for (unsigned n = 0; n < 256; n++) {
+        unsigned c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        png_crc32_tables[0][n] = c;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int n = 0; n < 256; n++) png_crc32_tables[k][n] = (png_crc32_tables[k - 1][n] >> 8) ^ png_crc32_tables[0][png_crc32_tables[k - 1][n] & 0xff];
+    }
+}
+
+#ifdef SIMD_X86
+//crc-32 by carry-less multiplication (Intel's "Fast CRC Computation Using PCLMULQDQ", as in zlib's crc32_simd):
+//four 128-bit lanes are folded forward 64 bytes at a time, folded into one, reduced to 64 bits and Barrett reduced
+//to the crc. Works on the inverted crc register, returns how many bytes it did (whole 16 byte blocks, none under 64)
+__attribute__((target("sse4.1,pclmul")))
+size_t png_crc32_clmul(unsigned* crc, const unsigned char* data, size_t size) {
+    if (size < 64) return 0;
+    const __m128i fold4 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4), fold1 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i fold32 = _mm_set_epi64x(0, 0x0163cd6124), barrett = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1 = _mm_loadu_si128((const __m128i*)data), x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 32)), x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)*crc));
+    size_t i = 64;
+    for (; i + 64 <= size; i += 64) {
+        __m128i y1 = _mm_clmulepi64_si128(x1, fold4, 0x00), y2 = _mm_clmulepi64_si128(x2, fold4, 0x00);
+        __m128i y3 = _mm_clmulepi64_si128(x3, fold4, 0x00), y4 = _mm_clmulepi64_si128(x4, fold4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, fold4, 0x11), y1), _mm_loadu_si128((const __m128i*)(data + i)));
+        x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, fold4, 0x11), y2), _mm_loadu_si128((const __m128i*)(data + i + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, fold4, 0x11), y3), _mm_loadu_si128((const __m128i*)(data + i + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x4, fold4, 0x11), y4), _mm_loadu_si128((const __m128i*)(data + i + 48)));
+    }
+    //fold the lanes into x1, then the remaining 16 byte blocks
+    __m128i next[3] = { x2, x3, x4 };
+    for (int k = 0; k < 3; k++) {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, fold1, 0x11), _mm_clmulepi64_si128(x1, fold1, 0x00)), next[k]);
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i y = _mm_loadu_si128((const __m128i*)(data + i));
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, fold1, 0x11), _mm_clmulepi64_si128(x1, fold1, 0x00)), y);
+    }
+    //128 to 64 bits, then 64 to 32
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, fold1, 0x10));
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), fold32, 0x00), _mm_srli_si128(x1, 4));
+    __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), barrett, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, low32), barrett, 0x00);
+    *crc = (unsigned)_mm_extract_epi32(_mm_xor_si128(x1, t), 1);
+    return i;
+}
+#endif
+
+//crc-32 of data continued from crc (0 to start), computed like zlib's crc32 but named apart so both can be linked into one program
+unsigned png_crc32_update(unsigned crc, const unsigned char* data, size_t size) {
+    pthread_once(&png_crc32_tables_once, build_png_crc32_tables);
+    unsigned c = ~crc;
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (cpu_clmul) i = png_crc32_clmul(&c, data, size);
+#endif
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= size; i += 8) {
+        unsigned lo, hi;
+        memcpy(&lo, data + i, 4);
+        memcpy(&hi, data + i + 4, 4);
+        lo ^= c;
+        c = png_crc32_tables[7][lo & 0xff] ^ png_crc32_tables[6][(lo >> 8) & 0xff] ^ png_crc32_tables[5][(lo >> 16) & 0xff] ^ png_crc32_tables[4][lo >> 24]
+            ^ png_crc32_tables[3][hi & 0xff] ^ png_crc32_tables[2][(hi >> 8) & 0xff] ^ png_crc32_tables[1][(hi >> 16) & 0xff] ^ png_crc32_tables[0][hi >> 24];
+    }
+#endif
+    for (; i < size; i++) c = png_crc32_tables[0][(c ^ data[i]) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+//STBIW_CRC32 for the PNG writer's chunk checksums
+unsigned png_crc32(unsigned char* buffer, int len) {
+    return png_crc32_update(0, buffer, len);
+}
+
+#ifdef SIMD_X86
+//adler-32 over 32 byte blocks: s1 gains each block's byte sum, and s2 the bytes weighted 32 down to 1 plus 32 times
+//the s1 before the block. Runs of up to 5552 bytes are summed in 32-bit lanes, then reduced. Returns how many
+//bytes it did, the rest are left to the scalar loop
+__attribute__((target("ssse3")))
+size_t adler32_ssse3(unsigned* adler, const unsigned char* data, size_t size) {
+    unsigned s1 = *adler & 0xffff, s2 = *adler >> 16;
+    const __m128i weights_lo = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i weights_hi = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i ones = _mm_set1_epi16(1);
+    size_t blocks = size / 32;
+    while (blocks > 0) {
+        size_t n = blocks < 5552 / 32 ? blocks : 5552 / 32;
+        blocks -= n;
+        //s1 before each block is s1 at the start plus the byte sums of the blocks before it
+        __m128i prefix = _mm_setr_epi32(s1 * n, 0, 0, 0);
+        __m128i sum = _mm_setzero_si128(), weighted = _mm_setr_epi32(s2, 0, 0, 0);
+        for (; n > 0; n--, data += 32) {
+            __m128i a = _mm_loadu_si128((const __m128i*)data), b = _mm_loadu_si128((const __m128i*)(data + 16));
+            prefix = _mm_add_epi32(prefix, sum);
+            sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_sad_epu8(a, _mm_setzero_si128()), _mm_sad_epu8(b, _mm_setzero_si128())));
+            weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_maddubs_epi16(a, weights_lo), ones));
+            weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_maddubs_epi16(b, weights_hi), ones));
+        }
+        weighted = _mm_add_epi32(weighted, _mm_slli_epi32(prefix, 5));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, _MM_SHUFFLE(2, 3, 0, 1)));
+        weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 = (s1 + (unsigned)_mm_cvtsi128_si32(sum)) % 65521;
+        s2 = (unsigned)_mm_cvtsi128_si32(weighted) % 65521;
+    }
+    *adler = s1 | (s2 << 16);
+    return size / 32 * 32;
+}
+#endif
+
+//adler-32 of data continued from adler, sums are reduced every 5552 bytes, the most that can't overflow 32 bits
+unsigned png_adler32(unsigned adler, const unsigned char* data, size_t size) {
+    size_t done = 0;
+#ifdef SIMD_X86
+    if (cpu_level >= CPU_SSSE3) done = adler32_ssse3(&adler, data, size);
+#endif
+    data += done;
+    size -= done;
+    unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+    while (size > 0) {
+        size_t n = size < 5552 ? size : 5552;
+        for (size_t i = 0; i < n; i++) {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+        data += n;
+        size -= n;
+    }
+    return s1 | (s2 << 16);
+}
+
+//adler-32 of two pieces joined, from each piece's adler-32 and the second one's length: every byte of the first
+//piece adds its s1 contribution to s2 once more for each byte of the second
+unsigned png_adler32_combine(unsigned adler1, unsigned adler2, size_t size2) {
+    const unsigned base = 65521;
+    unsigned rem = size2 % base;
+    unsigned s1 = adler1 & 0xffff;
+    unsigned s2 = (unsigned)(((unsigned long long)rem * s1) % base);
+    s1 += (adler2 & 0xffff) + base - 1;
+    s2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if (s1 >= base) s1 -= base;
+    if (s1 >= base) s1 -= base;
+    if (s2 >= 2 * base) s2 -= 2 * base;
+    if (s2 >= base) s2 -= base;
+    return s1 | (s2 << 16);
+}
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+
+//one chunk of the data, compressed to a raw deflate stream that ends on a byte boundary
+struct deflate_chunk {
+    unsigned char* data;
+    size_t size, capacity;
+    unsigned adler;
+};
+
+//match finder effort per compression level (stbi_write_png_compression_level, 0 stores the data uncompressed),
+//as in zlib: how many earlier positions with the same hash are compared, the match length that ends the search
+//early, the length of a held match past which only a quarter of the chain is searched for a longer one, and the
+//length under which a match is held back for a longer one at the next byte (0 takes every match right away).
+//Level 1 also leaves the positions inside matches longer than its nice length out of the hash chains
+struct deflate_level {
+    int chain, nice, good, lazy;
+};
+const struct deflate_level DEFLATE_LEVELS[10] = {
+    { 0, 0, 0, 0 }, { 4, 16, 0, 0 }, { 8, 32, 0, 0 }, { 8, 32, 4, 8 }, { 8, 32, 8, 16 },
+    { 16, 32, 8, 16 }, { 16, 64, 8, 32 }, { 24, 128, 8, 64 }, { 32, 128, 8, 64 }, { 256, 258, 32, 258 },
+};
+
+//hash chains over the window: head holds the latest position of each hash of 4 bytes and prev, indexed by
+//position modulo the window size, the position before it with the same hash
+struct match_finder {
+    const unsigned char* data;
+    int* head;
+    int* prev;
+    int chain, nice, good;
+};
+
+static inline unsigned hash4(const unsigned char* p) {
+    unsigned v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline void match_insert(struct match_finder* m, int pos) {
+    unsigned h = hash4(m->data + pos);
+    m->prev[pos & (DEFLATE_WINDOW - 1)] = m->head[h];
+    m->head[h] = pos;
+}
+
+//number of equal bytes at a and b, up to max, compared 8 bytes at a time: the first differing byte is the lowest
+//set byte of the xor on little endian machines
+static inline int match_length(const unsigned char* a, const unsigned char* b, int max) {
+    int n = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; n + 8 <= max; n += 8) {
+        unsigned long long x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+    }
+#endif
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+//longest match for position i no longer than max, walking the chain from the latest position with i's hash.
+//A candidate is only compared in full when it matches the byte that would make it longer than the best so far.
+//Returns the length if it is at least 4 and longer than held (the lazily held match's length), else 0, and
+//sets *distance
+static inline int longest_match(const struct match_finder* m, int i, int max, int held, int* distance) {
+    const unsigned char* p = m->data + i;
+    int best = held > 3 ? held : 3, chain = m->chain;
+    if (max <= best) return 0;
+    if (held && held >= m->good) chain >>= 2;
+    int nice = m->nice < max ? m->nice : max;
+    for (int candidate = m->head[hash4(p)]; candidate >= 0 && i - candidate <= DEFLATE_WINDOW && chain-- > 0;
+        candidate = m->prev[candidate & (DEFLATE_WINDOW - 1)]) {
+        const unsigned char* c = m->data + candidate;
+        if (c[best] != p[best]) continue;
+        int length = match_length(c, p, max);
+        if (length > best) {
+            best = length;
+            *distance = i - candidate;
+            if (length >= nice) break;
+        }
+    }
+    return best > 3 && best > held ? best : 0;
+}
+
+//block symbols buffered before their block's codes are chosen: a literal byte with distance 0, or a match
+struct deflate_symbol {
+    unsigned short value, distance;
+};
+
+struct symbol_count {
+    unsigned count;
+    int symbol;
+};
+
+int compare_symbol_counts(const void* a, const void* b) {
+    const struct symbol_count *x = a, *y = b;
+    return x->count != y->count ? (x->count > y->count) - (x->count < y->count) : x->symbol - y->symbol;
+}
+
+//huffman code lengths of no more than limit bits for symbols with the given counts, 0 for unused symbols. Lengths
+//come from the in-place algorithm of Moffat and Katajainen on the sorted counts, then codes over the limit are cut
+//to it and the Kraft sum is restored by lengthening the longest codes below the limit (as miniz does). At least
+//two symbols get a code so every tree is complete
+void huffman_lengths(const unsigned* counts, int n, int limit, unsigned char* lengths) {
+    struct symbol_count sorted[288];
+    int used = 0;
+    for (int i = 0; i < n; i++) {
+        lengths[i] = 0;
+        if (counts[i]) sorted[used++] = (struct symbol_count){ counts[i], i };
+    }
+    for (int i = 0; used < 2; i++) {
+        if (!counts[i]) sorted[used++] = (struct symbol_count){ 1, i };
+    }
+    qsort(sorted, used, sizeof(*sorted), compare_symbol_counts);
+
+    //pass 1 turns the counts into parent links of the tree, pass 2 into internal node depths, pass 3 into leaf depths
+    sorted[0].count += sorted[1].count;
+    int root = 0, leaf = 2;
+    for (int next = 1; next < used - 1; next++) {
+        if (leaf >= used || sorted[root].count < sorted[leaf].count) {
+            sorted[next].count = sorted[root].count;
+            sorted[root++].count = next;
+        }
+        else sorted[next].count = sorted[leaf++].count;
+        if (leaf >= used || (root < next && sorted[root].count < sorted[leaf].count)) {
+            sorted[next].count += sorted[root].count;
+            sorted[root++].count = next;
+        }
+        else sorted[next].count += sorted[leaf++].count;
+    }
+    sorted[used - 2].count = 0;
+    for (int next = used - 3; next >= 0; next--) sorted[next].count = sorted[sorted[next].count].count + 1;
+    int available = 1, internal = 0, depth = 0, next = used - 1;
+    root = used - 2;
+    while (available > 0) {
+        while (root >= 0 && (int)sorted[root].count == depth) {
+            internal++;
+            root--;
+        }
+        while (available > internal) {
+            sorted[next--].count = depth;
+            available--;
+        }
+        available = 2 * internal;
+        depth++;
+        internal = 0;
+    }
+
+    int per_length[33] = { 0 };
+    for (int i = 0; i < used; i++) per_length[sorted[i].count < 32 ? sorted[i].count : 32]++;
+    for (int i = limit + 1; i <= 32; i++) {
+        per_length[limit] += per_length[i];
+        per_length[i] = 0;
+    }
+    unsigned total = 0;
+    for (int i = limit; i > 0; i--) total += (unsigned)per_length[i] << (limit - i);
+    for (; total != 1u << limit; total--) {
+        per_length[limit]--;
+        for (int i = limit - 1; i > 0; i--) {
+            if (per_length[i]) {
+                per_length[i]--;
+                per_length[i + 1] += 2;
+                break;
+            }
+        }
+    }
+    //the most frequent symbols take the shortest codes
+    for (int length = 1, j = used; length <= limit; length++) {
+        for (int k = per_length[length]; k > 0; k--) lengths[sorted[--j].symbol] = length;
+    }
+}
+
+//canonical huffman codes for the lengths, bit reversed
+void huffman_codes(const unsigned char* lengths, int n, unsigned short (*codes)[2]) {
+    int per_length[16] = { 0 }, next[16];
+    for (int i = 0; i < n; i++) per_length[lengths[i]]++;
+    per_length[0] = 0;
+    for (int length = 1, code = 0; length < 16; length++) {
+        code = (code + per_length[length - 1]) << 1;
+        next[length] = code;
+    }
+    for (int i = 0; i < n; i++) {
+        codes[i][1] = lengths[i];
+        codes[i][0] = lengths[i] ? reverse_bits(next[lengths[i]]++, lengths[i]) : 0;
+    }
+}
+
+//order the code length code lengths are sent in
+const unsigned char CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+//a dynamic huffman block's codes and header: the code lengths of the literal/length and distance codes, run length
+//coded with symbols 16 (repeat the last length 3-6 times), 17 (3-10 zeros) and 18 (11-138 zeros), which are
+//huffman coded themselves with lengths of up to 7 bits
+struct dynamic_header {
+    struct deflate_codes codes;
+    int litlen_count, dist_count, length_code_count;
+    unsigned char lengths[286 + 30];
+    unsigned char runs[286 + 30][2];
+    int run_count;
+    unsigned char length_lengths[19];
+    unsigned short length_codes[19][2];
+};
+
+//plans a dynamic block for the symbol counts, returns its size in bits
+size_t plan_dynamic_block(const unsigned* litlen_counts, const unsigned* dist_counts, struct dynamic_header* h) {
+    huffman_lengths(litlen_counts, 286, 15, h->lengths);
+    huffman_lengths(dist_counts, 30, 15, h->lengths + 286);
+    huffman_codes(h->lengths, 286, h->codes.litlen);
+    huffman_codes(h->lengths + 286, 30, h->codes.dist);
+    h->litlen_count = 286;
+    while (h->litlen_count > 257 && !h->lengths[h->litlen_count - 1]) h->litlen_count--;
+    h->dist_count = 30;
+    while (h->dist_count > 1 && !h->lengths[286 + h->dist_count - 1]) h->dist_count--;
+    //the distance lengths follow the literal/length ones directly, runs may cross from one into the other
+    unsigned char all[286 + 30];
+    int total = h->litlen_count + h->dist_count;
+    memcpy(all, h->lengths, h->litlen_count);
+    memcpy(all + h->litlen_count, h->lengths + 286, h->dist_count);
+
+    unsigned counts[19] = { 0 };
+    h->run_count = 0;
+    for (int i = 0; i < total;) {
+        int length = all[i], run = 1;
+        while (i + run < total && all[i + run] == length) run++;
+        if (length == 0 && run >= 3) {
+            if (run > 138) run = 138;
+            h->runs[h->run_count][0] = run >= 11 ? 18 : 17;
+            h->runs[h->run_count++][1] = run >= 11 ? run - 11 : run - 3;
+            i += run;
+            continue;
+        }
+        h->runs[h->run_count][0] = length;
+        h->runs[h->run_count++][1] = 0;
+        i++;
+        for (run--; length != 0 && run >= 3; run -= run < 6 ? run : 6) {
+            h->runs[h->run_count][0] = 16;
+            h->runs[h->run_count++][1] = (run < 6 ? run : 6) - 3;
+            i += run < 6 ? run : 6;
+        }
+    }
+    for (int i = 0; i < h->run_count; i++) counts[h->runs[i][0]]++;
+    huffman_lengths(counts, 19, 7, h->length_lengths);
+    huffman_codes(h->length_lengths, 19, h->length_codes);
+    h->length_code_count = 19;
+    while (h->length_code_count > 4 && !h->length_lengths[CODE_LENGTH_ORDER[h->length_code_count - 1]]) h->length_code_count--;
+
+    size_t bits = 3 + 5 + 5 + 4 + 3 * h->length_code_count + 2 * counts[16] + 3 * counts[17] + 7 * counts[18];
+    for (int i = 0; i < 19; i++) bits += (size_t)counts[i] * h->length_lengths[i];
+    for (int i = 0; i < 286; i++) bits += (size_t)litlen_counts[i] * h->lengths[i];
+    for (int i = 0; i < 30; i++) bits += (size_t)dist_counts[i] * h->lengths[286 + i];
+    return bits;
+}
+
+void write_dynamic_header(struct deflate_writer* w, const struct dynamic_header* h) {
+    deflate_put(w, h->litlen_count - 257, 5);
+    deflate_put(w, h->dist_count - 1, 5);
+    deflate_put(w, h->length_code_count - 4, 4);
+    for (int i = 0; i < h->length_code_count; i++) deflate_put(w, h->length_lengths[CODE_LENGTH_ORDER[i]], 3);
+    for (int i = 0; i < h->run_count; i++) {
+        int symbol = h->runs[i][0];
+        deflate_put(w, h->length_codes[symbol][0], h->length_codes[symbol][1]);
+        if (symbol >= 16) deflate_put(w, h->runs[i][1], symbol == 16 ? 2 : symbol == 17 ? 3 : 7);
+    }
+}
+
+//stored blocks of data[start, end), at least one so an empty block can end the stream
+void write_stored(struct deflate_writer* w, const unsigned char* data, int start, int end, int last) {
+    int j = start;
+    do {
+        int length = end - j < 65535 ? end - j : 65535;
+        deflate_put(w, last && j + length == end, 3);
+        deflate_align(w);
+        deflate_put(w, length | (~length & 0xffffu) << 16, 32);
+        memcpy(w->p, data + j, length);
+        w->p += length;
+        j += length;
+    } while (j < end);
+}
+
+#define DEFLATE_SEGMENT 4096
+#define DEFLATE_BLOCK_SYMBOLS 32768
+
+//symbol counts of a run of symbols, with the end of block symbol counted once, and the data bytes they cover
+struct symbol_counts {
+    unsigned litlen[286], dist[30];
+    int size;
+};
+
+//symbols buffered for the blocks of a chunk: the pending block, then the segment being collected. Once a segment
+//is full it is either appended to the pending block or, if the two are smaller coded apart than together (their
+//symbol statistics differ enough to pay for a second header), the pending block is written and the segment
+//becomes the next one
+struct deflate_blocks {
+    struct deflate_writer* w;
+    const unsigned char* data;
+    struct deflate_symbol* symbols;
+    int block_count, count;
+    int start; //data position of the pending block
+    struct symbol_counts block, segment;
+    size_t block_bits;
+};
+
+void reset_counts(struct symbol_counts* c) {
+    memset(c, 0, sizeof(*c));
+    c->litlen[256] = 1;
+}
+
+//smallest of the block sizes in bits for the counts coded as a dynamic, fixed or stored block, fills h for dynamic
+size_t block_bits(const struct symbol_counts* c, struct dynamic_header* h, int* type) {
+    size_t dynamic = plan_dynamic_block(c->litlen, c->dist, h), fixed = 3, extra = 0;
+    for (int i = 0; i < 286; i++) fixed += (size_t)c->litlen[i] * fixed_codes.litlen[i][1];
+    for (int i = 0; i < 30; i++) fixed += (size_t)c->dist[i] * 5;
+    for (int i = 0; i < 29; i++) extra += (size_t)c->litlen[257 + i] * DEFLATE_LENGTH_EXTRA[i];
+    for (int i = 0; i < 30; i++) extra += (size_t)c->dist[i] * DEFLATE_DIST_EXTRA[i];
+    size_t stored = 8 * ((size_t)c->size + 5 * ((size_t)c->size / 65535 + 1));
+    *type = dynamic < fixed ? 2 : 1;
+    size_t bits = (dynamic < fixed ? dynamic : fixed) + extra;
+    if (stored < bits) {
+        *type = 0;
+        return stored;
+    }
+    return bits;
+}
+
+//writes the pending block as whichever of stored, fixed or dynamic is smallest
+void write_block(struct deflate_blocks* b, int last) {
+    struct dynamic_header h;
+    int type;
+    block_bits(&b->block, &h, &type);
+    if (type == 0) write_stored(b->w, b->data, b->start, b->start + b->block.size, last);
+    else {
+        const struct deflate_codes* codes = type == 2 ? &h.codes : &fixed_codes;
+        deflate_put(b->w, last | type << 1, 3);
+        if (type == 2) write_dynamic_header(b->w, &h);
+        for (int i = 0; i < b->block_count; i++) {
+            const struct deflate_symbol* s = &b->symbols[i];
+            if (s->distance) deflate_match(b->w, codes, s->value, s->distance);
+            else deflate_literal(b->w, codes, s->value);
+        }
+        deflate_literal(b->w, codes, 256);
+    }
+    b->start += b->block.size;
+}
+
+//ends the segment: joins it to the pending block or writes that block and starts the next one with the segment
+void end_segment(struct deflate_blocks* b) {
+    struct dynamic_header h;
+    int type;
+    if (b->count == b->block_count) return;
+    size_t segment_bits = block_bits(&b->segment, &h, &type);
+    struct symbol_counts joined = b->block;
+    for (int i = 0; i < 286; i++) joined.litlen[i] += b->segment.litlen[i];
+    for (int i = 0; i < 30; i++) joined.dist[i] += b->segment.dist[i];
+    joined.litlen[256] = 1;
+    joined.size += b->segment.size;
+    size_t joined_bits = b->block_count ? block_bits(&joined, &h, &type) : segment_bits;
+    if (b->block_count && b->block_bits + segment_bits < joined_bits) {
+        write_block(b, 0);
+        memmove(b->symbols, b->symbols + b->block_count, (b->count - b->block_count) * sizeof(*b->symbols));
+        b->count -= b->block_count;
+        b->block = b->segment;
+        b->block_bits = segment_bits;
+    }
+    else {
+        b->block = joined;
+        b->block_bits = joined_bits;
+    }
+    b->block_count = b->count;
+    reset_counts(&b->segment);
+    if (b->block_count >= DEFLATE_BLOCK_SYMBOLS) {
+        write_block(b, 0);
+        b->count = b->block_count = 0;
+        reset_counts(&b->block);
+    }
+}
+
+static inline void block_literal(struct deflate_blocks* b, int c) {
+    b->symbols[b->count++] = (struct deflate_symbol){ c, 0 };
+    b->segment.litlen[c]++;
+    b->segment.size++;
+    if (b->count - b->block_count == DEFLATE_SEGMENT) end_segment(b);
+}
+
+static inline void block_match(struct deflate_blocks* b, int length, int distance) {
+    b->symbols[b->count++] = (struct deflate_symbol){ length, distance };
+    b->segment.litlen[257 + length_codes[length]]++;
+    b->segment.dist[dist_code(distance)]++;
+    b->segment.size += length;
+    if (b->count - b->block_count == DEFLATE_SEGMENT) end_segment(b);
+}
+
+static inline void emit_literal(struct deflate_blocks* b, int c) {
+    if (b->symbols) block_literal(b, c);
+    else deflate_literal(b->w, &fixed_codes, c);
+}
+
+static inline void emit_match(struct deflate_blocks* b, int length, int distance) {
+    if (b->symbols) block_match(b, length, distance);
+    else deflate_match(b->w, &fixed_codes, length, distance);
+}
+
+//compresses data[start, end) to deflate blocks, matches may reach back into the 32 KB before start so the chunk
+//compresses as well as it would inside one stream. Levels up to DEFLATE_FIXED_LEVEL write one block with the fixed
+//huffman codes as matches are found, higher ones buffer the symbols and split them into blocks with codes of their
+//own. The last chunk ends the stream, the others end with an empty stored block, which pads them to a byte boundary
+//like a zlib sync flush. Chunks that don't shrink are stored instead. Returns 0 if memory runs out
+int deflate_chunk(struct deflate_chunk* chunk, const unsigned char* data, int data_len, int start, int end, int level, int last) {
+    int size = end - start;
+    //fixed codes take at most 9 bits per byte, stored blocks 5 bytes per 65535 and per block
+    size_t stored = size + 5 * ((size_t)size / 65535 + 1);
+    chunk->capacity = (size_t)size * 9 / 8 + stored - size + 64;
+    chunk->data = pool_alloc(chunk->capacity);
+    chunk->adler = png_adler32(1, data + start, size);
+    if (!chunk->data) return 0;
+
+    struct deflate_writer w = { chunk->data, 0, 0 };
+    if (level > 0) {
+        const struct deflate_level* config = &DEFLATE_LEVELS[level < 9 ? level : 9];
+        size_t scratch = ((1 << DEFLATE_HASH_BITS) + DEFLATE_WINDOW) * sizeof(int);
+        size_t symbols = (DEFLATE_BLOCK_SYMBOLS + DEFLATE_SEGMENT) * sizeof(struct deflate_symbol);
+        struct match_finder m = { data, pool_alloc(scratch), NULL, config->chain, config->nice, config->good };
+        struct deflate_blocks b = { .w = &w, .data = data, .symbols = level > DEFLATE_FIXED_LEVEL ? pool_alloc(symbols) : NULL, .start = start };
+        if (!m.head || (level > DEFLATE_FIXED_LEVEL && !b.symbols)) {
+            if (m.head) pool_free(m.head, scratch);
+            if (b.symbols) pool_free(b.symbols, symbols);
+            return 0;
+        }
+        m.prev = m.head + (1 << DEFLATE_HASH_BITS);
+        memset(m.head, 0xff, (1 << DEFLATE_HASH_BITS) * sizeof(int));
+        //positions are hashed while 4 bytes are left, which can reach into the next chunk
+        int hash_end = data_len - 3;
+        for (int i = start > DEFLATE_WINDOW ? start - DEFLATE_WINDOW : 0; i < start && i < hash_end; i++) match_insert(&m, i);
+
+        if (b.symbols) {
+            reset_counts(&b.block);
+            reset_counts(&b.segment);
+        }
+        else {
+            deflate_put(&w, last, 1);
+            deflate_put(&w, 1, 2); //fixed huffman codes
+        }
+        int i = start;
+        //lazy matching keeps the match found at the previous byte, which is emitted unless this byte has a longer one
+        int prev_length = 0, prev_distance = 0;
+        while (i < end) {
+            int max = end - i < 258 ? end - i : 258;
+            int distance = 0;
+            int length = i < hash_end ? longest_match(&m, i, max, prev_length, &distance) : 0;
+            if (i < hash_end) match_insert(&m, i);
+            if (prev_length && !length) {
+                //the match from i - 1 wins, its remaining positions are hashed and skipped
+                emit_match(&b, prev_length, prev_distance);
+                for (int j = i + 1; j < i - 1 + prev_length; j++) {
+                    if (j < hash_end) match_insert(&m, j);
+                }
+                i += prev_length - 1;
+                prev_length = 0;
+                continue;
+            }
+            if (config->lazy) {
+                if (prev_length) emit_literal(&b, data[i - 1]);
+                if (length && length < config->lazy) {
+                    prev_length = length;
+                    prev_distance = distance;
+                    i++;
+                    continue;
+                }
+                prev_length = 0;
+            }
+            if (length) {
+                //level 1 only hashes positions inside short matches, long runs are skipped over
+                emit_match(&b, length, distance);
+                if (level > 1 || length <= config->nice) {
+                    for (int j = i + 1; j < i + length; j++) {
+                        if (j < hash_end) match_insert(&m, j);
+                    }
+                }
+                i += length;
+            }
+            else emit_literal(&b, data[i++]);
+        }
+        pool_free(m.head, scratch);
+        if (b.symbols) {
+            end_segment(&b);
+            if (b.block_count || last) write_block(&b, last);
+            pool_free(b.symbols, symbols);
+        }
+        else deflate_literal(&w, &fixed_codes, 256);
+        if (!last) write_stored(&w, data, end, end, 0);
+        deflate_align(&w);
+    }
+    chunk->size = w.p - chunk->data;
+
+    if (level <= 0 || chunk->size > stored) {
+        w = (struct deflate_writer){ chunk->data, 0, 0 };
+        write_stored(&w, data, start, end, last);
+        chunk->size = w.p - chunk->data;
+    }
+    return 1;
+}
+
+//STBIW_ZLIB_COMPRESS for the PNG writer: like stbi_zlib_compress, but the data is split into DEFLATE_CHUNK byte
+//chunks compressed by parallel tasks (pigz style), so a large image isn't compressed by one thread while the others
+//idle. The chunks' raw deflate streams are joined behind one zlib header, with the adler-32 combined from theirs.
+//Returns a buffer freed with STBIW_FREE, or NULL on failure
+unsigned char* deflate_parallel(unsigned char* data, int data_len, int* out_len, int quality) {
+    pthread_once(&deflate_tables_once, build_deflate_tables);
+    int chunk_size = DEFLATE_CHUNK > 0 ? DEFLATE_CHUNK : INT_MAX;
+    int chunks = data_len > 0 ? 1 + (data_len - 1) / chunk_size : 1;
+    struct deflate_chunk* parts = calloc(chunks, sizeof(*parts));
+    if (!parts) return NULL;
+    int failed = 0;
+    //libgomp runs a taskloop's tasks undeferred on this thread once a team has over 64 per thread queued, so a
+    //large image gets a few tasks per thread that take a run of chunks each rather than one task per chunk
+    int tasks = 4 * omp_get_num_threads();
+#pragma omp taskloop num_tasks(chunks < tasks ? chunks : tasks) if(chunks > 1) shared(failed)
+    for (int c = 0; c < chunks; c++) {
+        int start = c * chunk_size, end = data_len - start > chunk_size ? start + chunk_size : data_len;
+        if (!deflate_chunk(&parts[c], data, data_len, start, end, quality, c == chunks - 1)) {
+#pragma omp atomic write
+            failed = 1;
+        }
+    }
+
+    size_t size = 2 + 4;
+    for (int c = 0; c < chunks; c++) size += parts[c].size;
+    unsigned char* out = failed || size > INT_MAX ? NULL : STBIW_MALLOC(size);
+    if (out) {
+        unsigned char* p = out;
+        *p++ = 0x78; //deflate, 32K window
+        *p++ = 0x5e;
+        unsigned adler = 1;
+        for (int c = 0; c < chunks; c++) {
+            memcpy(p, parts[c].data, parts[c].size);
+            p += parts[c].size;
+            int length = (c == chunks - 1 ? data_len : (c + 1) * chunk_size) - c * chunk_size;
+            adler = png_adler32_combine(adler, parts[c].adler, length);
+        }
+        for (int i = 3; i >= 0; i--) *p++ = (unsigned char)(adler >> (8 * i));
+        *out_len = (int)size;
+    }
+    for (int c = 0; c < chunks; c++) {
+        if (parts[c].data) pool_free(parts[c].data, parts[c].capacity);
+    }
+    free(parts);
+    return out;
+}
+
+//encodes an image in the format of its file extension (png or jpg), returns 0 on failure or an unsupported extension
+int encode_image(const struct image_buffer* image, const char* ext, struct encoded* out) {
+    int ok = 0;
+    if (strcmp(ext, "png") == 0) {
+        ok = stbi_write_png_to_func(encoded_append, out, image->width, image->height, image->channels, image->pixels, image->width * image->channels);
+    }
+    else if (strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) {
+        ok = stbi_write_jpg_to_func(encoded_append, out, image->width, image->height, image->channels, image->pixels, 100);
+    }
+    return ok && !out->failed;
+}
+
+//huffman tables of JPEG Annex K (the ones stb_image_write uses): code counts per length 1-16 and the symbols
+//in code order, [0] for luma and [1] for chroma
+const unsigned char JPEG_DC_COUNTS[2][16] = {
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+};
+const unsigned char JPEG_DC_VALUES[2][12] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 },
+};
+const unsigned char JPEG_AC_COUNTS[2][16] = {
+    { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+    { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+};
+const unsigned char JPEG_AC_VALUES[2][162] = {
+    { 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+      0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+      0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+      0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+      0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+      0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+      0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa },
+    { 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+      0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+      0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+      0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+      0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+      0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+      0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+      0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa },
+};
+
+//code and length for each symbol of the tables above, symbols the tables don't have keep length 0
+unsigned short jpeg_dc_codes[2][256][2], jpeg_ac_codes[2][256][2];
+pthread_once_t jpeg_codes_once = PTHREAD_ONCE_INIT;
+
+//assigns canonical huffman codes: consecutive within a length, shifted left by one for each longer length
+void build_huffman_codes(unsigned short codes[256][2], const unsigned char counts[16], const unsigned char* values) {
+    int code = 0, k = 0;
+    for (int length = 1; length <= 16; length++) {
+        for (int i = 0; i < counts[length - 1]; i++, k++) {
+            codes[values[k]][0] = code++;
+            codes[values[k]][1] = length;
+        }
+        code <<= 1;
+    }
+}
+
+void build_jpeg_codes(void) {
+    for (int t = 0; t < 2; t++) {
+        build_huffman_codes(jpeg_dc_codes[t], JPEG_DC_COUNTS[t], JPEG_DC_VALUES[t]);
+        build_huffman_codes(jpeg_ac_codes[t], JPEG_AC_COUNTS[t], JPEG_AC_VALUES[t]);
+    }
+}
+
+//decodes a baseline scan's blocks into the components' coefficient arrays, like stbi__parse_entropy_coded_data
+//but with a quantization table of ones and no inverse DCT, so the blocks keep their quantized coefficients
+int jpeg_baseline_scan(stbi__jpeg* z) {
+    stbi__uint16 unit[64];
+    for (int i = 0; i < 64; i++) unit[i] = 1;
+    stbi__jpeg_reset(z);
+    //a single component scan codes the component's own blocks in raster order, otherwise every block of each MCU
+    int single = z->scan_n == 1;
+    int first = z->order[0];
+    int mcu_x = single ? (z->img_comp[first].x + 7) >> 3 : z->img_mcu_x;
+    int mcu_y = single ? (z->img_comp[first].y + 7) >> 3 : z->img_mcu_y;
+    for (int j = 0; j < mcu_y; j++) {
+        for (int i = 0; i < mcu_x; i++) {
+            for (int k = 0; k < z->scan_n; k++) {
+                int n = z->order[k];
+                int h = single ? 1 : z->img_comp[n].h, v = single ? 1 : z->img_comp[n].v;
+                for (int y = 0; y < v; y++) {
+                    for (int x = 0; x < h; x++) {
+                        short* block = z->img_comp[n].coeff + 64 * ((i * h + x) + (size_t)(j * v + y) * z->img_comp[n].coeff_w);
+                        int ha = z->img_comp[n].ha;
+                        if (!stbi__jpeg_decode_block(z, block, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, unit)) return 0;
+                    }
+                }
+            }
+            if (--z->todo <= 0) {
+                if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+                if (!STBI__RESTART(z->marker)) return 1;
+                stbi__jpeg_reset(z);
+            }
+        }
+    }
+    return 1;
+}
+
+//reads a jpeg's quantized DCT coefficients into its components' coeff arrays (coeff_w by coeff_h blocks of 64, in
+//natural order), following stbi__decode_jpeg_image but stopping before dequantization and the inverse DCT.
+//Progressive scans collect coefficients already, baseline scans go through jpeg_baseline_scan. Returns 0 on failure
+int jpeg_read_coefficients(stbi__jpeg* z) {
+    z->restart_interval = 0;
+    if (!stbi__decode_jpeg_header(z, STBI__SCAN_load)) return 0;
+    for (int i = 0; i < z->s->img_n; i++) {
+        //pixel planes aren't needed, padding blocks a scan doesn't cover are left zero
+        STBI_FREE(z->img_comp[i].raw_data);
+        z->img_comp[i].raw_data = NULL;
+        z->img_comp[i].data = NULL;
+        size_t size = (size_t)z->img_comp[i].w2 * z->img_comp[i].h2 * sizeof(short);
+        if (!z->progressive) {
+            z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
+            z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
+            z->img_comp[i].raw_coeff = STBI_MALLOC(size + 15);
+            if (!z->img_comp[i].raw_coeff) return 0;
+            z->img_comp[i].coeff = (short*)(((size_t)z->img_comp[i].raw_coeff + 15) & ~15);
+        }
+        memset(z->img_comp[i].coeff, 0, size);
+    }
+    int m = stbi__get_marker(z);
+    while (!stbi__EOI(m)) {
+        if (stbi__SOS(m)) {
+            if (!stbi__process_scan_header(z)) return 0;
+            if (!(z->progressive ? stbi__parse_entropy_coded_data(z) : jpeg_baseline_scan(z))) return 0;
+            if (z->marker == STBI__MARKER_none) z->marker = stbi__skip_jpeg_junk_at_end(z);
+            m = stbi__get_marker(z);
+            if (STBI__RESTART(m)) m = stbi__get_marker(z);
+        }
+        else if (stbi__DNL(m)) {
+            int length = stbi__get16be(z->s);
+            stbi__uint32 lines = stbi__get16be(z->s);
+            if (length != 4 || lines != z->s->img_y) return 0;
+            m = stbi__get_marker(z);
+        }
+        else {
+            //like the decoder, whatever can't be parsed after the scans is ignored
+            if (!stbi__process_marker(z, m)) return 1;
+            m = stbi__get_marker(z);
+        }
+    }
+    return 1;
+}
+
+//where each coefficient of a transformed block comes from: zigzag position k takes source coefficient from[k]
+//(natural order) times sign[k]. A transpose swaps the horizontal and vertical frequencies and mirroring an axis
+//negates the odd frequencies along it, since odd DCT basis functions are antisymmetric
+struct block_map {
+    unsigned char from[64];
+    signed char sign[64];
+};
+
+void plan_block_map(struct block_map* map, int swap, int mirror_x, int mirror_y) {
+    for (int k = 0; k < 64; k++) {
+        int n = stbi__jpeg_dezigzag[k];
+        int u = swap ? n >> 3 : n & 7, v = swap ? n & 7 : n >> 3;
+        map->from[k] = v * 8 + u;
+        map->sign[k] = (((u & mirror_x) ^ (v & mirror_y)) & 1) ? -1 : 1;
+    }
+}
+
+//msb first bit writer for entropy coded data, a 0xff byte is followed by a stuffed 0
+struct bit_writer {
+    unsigned char* p;
+    unsigned long long bits;
+    int count;
+};
+
+static inline void put_bits(struct bit_writer* w, unsigned code, int length) {
+    w->bits = (w->bits << length) | code;
+    w->count += length;
+    while (w->count >= 8) {
+        w->count -= 8;
+        unsigned char c = (unsigned char)(w->bits >> w->count);
+        *w->p++ = c;
+        if (c == 0xff) *w->p++ = 0;
+    }
+}
+
+//bytes one block can take at most: 64 codes of 16 bits plus 11 value bits, every byte stuffed
+#define JPEG_BLOCK_BYTES 512
+
+//huffman codes one transformed block, returns 0 for a coefficient the tables have no code for (corrupt input)
+int put_block(struct bit_writer* w, const short* src, const struct block_map* map, int* dc, unsigned short dc_codes[256][2], unsigned short ac_codes[256][2]) {
+    int zz[64], last = 0;
+    for (int k = 0; k < 64; k++) {
+        zz[k] = map->sign[k] * src[map->from[k]];
+        if (zz[k]) last = k;
+    }
+    unsigned short bits[2] = { 0, 0 };
+    int diff = zz[0] - *dc;
+    *dc = zz[0];
+    if (diff) stbiw__jpg_calcBits(diff, bits);
+    if (!dc_codes[bits[1]][1]) return 0;
+    put_bits(w, dc_codes[bits[1]][0], dc_codes[bits[1]][1]);
+    put_bits(w, bits[0], bits[1]);
+    for (int k = 1; k <= last; k++) {
+        int run = 0;
+        for (; zz[k] == 0; k++) run++;
+        for (; run >= 16; run -= 16) put_bits(w, ac_codes[0xf0][0], ac_codes[0xf0][1]);
+        stbiw__jpg_calcBits(zz[k], bits);
+        int symbol = (run << 4) | bits[1];
+        if (bits[1] > 15 || !ac_codes[symbol][1]) return 0;
+        put_bits(w, ac_codes[symbol][0], ac_codes[symbol][1]);
+        put_bits(w, bits[0], bits[1]);
+    }
+    if (last != 63) put_bits(w, ac_codes[0][0], ac_codes[0][1]);
+    return 1;
+}
+
+static inline unsigned char* put16(unsigned char* p, int value) {
+    *p++ = value >> 8;
+    *p++ = value & 255;
+    return p;
+}
+
+//writes the coefficients read by jpeg_read_coefficients as a baseline jpeg with transform t applied: blocks move to
+//their transformed positions and are remapped by plan_block_map, quantization tables and sampling factors are
+//transposed along with them. A mirrored axis must be a whole number of MCUs, as the partial MCU at the far edge
+//would otherwise become the first one. Returns 0 if the image can't be transformed this way
+int write_transformed_jpeg(stbi__jpeg* z, const struct transform* t, struct encoded* out) {
+    int n = z->s->img_n;
+    int swap = transform_swaps_axes(t);
+    int mirror_x = t->m[0][0] + t->m[1][0] < 0, mirror_y = t->m[0][1] + t->m[1][1] < 0;
+    //a greyscale image is coded one block at a time, whatever its sampling factors say
+    int h_max = n == 1 ? 1 : z->img_h_max, v_max = n == 1 ? 1 : z->img_v_max;
+    if ((mirror_x && z->s->img_x % (8 * h_max)) || (mirror_y && z->s->img_y % (8 * v_max))) return 0;
+    int width = swap ? z->s->img_y : z->s->img_x, height = swap ? z->s->img_x : z->s->img_y;
+    for (int c = 0; c < n; c++) {
+        for (int i = 0; i < 64; i++) {
+            if (z->dequant[z->img_comp[c].tq][i] > 255) return 0;
+        }
+    }
+    pthread_once(&jpeg_codes_once, build_jpeg_codes);
+    struct block_map map;
+    plan_block_map(&map, swap, mirror_x, mirror_y);
+
+    //headers: JFIF, the quantization tables in use, the frame, the huffman tables and the scan
+    unsigned char* p = encoded_reserve(out, 1024);
+    if (!p) return 0;
+    unsigned char* start = p;
+    static const unsigned char jfif[] = { 0xff, 0xd8, 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    memcpy(p, jfif, sizeof(jfif));
+    p += sizeof(jfif);
+    int tables_written = 0;
+    for (int c = 0; c < n; c++) {
+        int tq = z->img_comp[c].tq;
+        if (tables_written & (1 << tq)) continue;
+        tables_written |= 1 << tq;
+        *p++ = 0xff;
+        *p++ = 0xdb;
+        p = put16(p, 67);
+        *p++ = tq;
+        for (int k = 0; k < 64; k++) *p++ = (unsigned char)z->dequant[tq][map.from[k]];
+    }
+    *p++ = 0xff;
+    *p++ = 0xc0;
+    p = put16(p, 8 + 3 * n);
+    *p++ = 8;
+    p = put16(p, height);
+    p = put16(p, width);
+    *p++ = n;
+    for (int c = 0; c < n; c++) {
+        int h = n == 1 ? 1 : z->img_comp[c].h, v = n == 1 ? 1 : z->img_comp[c].v;
+        *p++ = z->img_comp[c].id;
+        *p++ = swap ? (v << 4) | h : (h << 4) | v;
+        *p++ = z->img_comp[c].tq;
+    }
+    for (int table = 0; table < (n == 1 ? 1 : 2); table++) {
+        *p++ = 0xff;
+        *p++ = 0xc4;
+        p = put16(p, 2 + 2 * 17 + sizeof(JPEG_DC_VALUES[0]) + sizeof(JPEG_AC_VALUES[0]));
+        *p++ = table;
+        memcpy(p, JPEG_DC_COUNTS[table], 16);
+        memcpy(p + 16, JPEG_DC_VALUES[table], sizeof(JPEG_DC_VALUES[0]));
+        p += 16 + sizeof(JPEG_DC_VALUES[0]);
+        *p++ = 0x10 | table;
+        memcpy(p, JPEG_AC_COUNTS[table], 16);
+        memcpy(p + 16, JPEG_AC_VALUES[table], sizeof(JPEG_AC_VALUES[0]));
+        p += 16 + sizeof(JPEG_AC_VALUES[0]);
+    }
+    *p++ = 0xff;
+    *p++ = 0xda;
+    p = put16(p, 6 + 2 * n);
+    *p++ = n;
+    for (int c = 0; c < n; c++) {
+        *p++ = z->img_comp[c].id;
+        *p++ = c == 0 ? 0x00 : 0x11;
+    }
+    *p++ = 0;
+    *p++ = 63;
+    *p++ = 0;
+    out->size += p - start;
+
+    //entropy coded data, one interleaved scan: MCUs in raster order of the output, each component's blocks within
+    //them in raster order. Output block (ox, oy) is source block (sx, sy) with the transform undone
+    int out_h_max = swap ? v_max : h_max, out_v_max = swap ? h_max : v_max;
+    int mcu_x = (width + 8 * out_h_max - 1) / (8 * out_h_max), mcu_y = (height + 8 * out_v_max - 1) / (8 * out_v_max);
+    int dc[4] = { 0 };
+    struct bit_writer w = { NULL, 0, 0 };
+    for (int my = 0; my < mcu_y; my++) {
+        for (int mx = 0; mx < mcu_x; mx++) {
+            for (int c = 0; c < n; c++) {
+                int h = n == 1 ? 1 : z->img_comp[c].h, v = n == 1 ? 1 : z->img_comp[c].v;
+                int out_h = swap ? v : h, out_v = swap ? h : v;
+                int blocks_x = (z->img_comp[c].x + 7) / 8, blocks_y = (z->img_comp[c].y + 7) / 8;
+                int table = c == 0 ? 0 : 1;
+                for (int y = 0; y < out_v; y++) {
+                    for (int x = 0; x < out_h; x++) {
+                        int ox = mx * out_h + x, oy = my * out_v + y;
+                        int sx = swap ? oy : ox, sy = swap ? ox : oy;
+                        if (mirror_x) sx = blocks_x - 1 - sx;
+                        if (mirror_y) sy = blocks_y - 1 - sy;
+                        const short* src = z->img_comp[c].coeff + 64 * (sx + (size_t)sy * z->img_comp[c].coeff_w);
+                        if (!(w.p = encoded_reserve(out, JPEG_BLOCK_BYTES))) return 0;
+                        int ok = put_block(&w, src, &map, &dc[c], jpeg_dc_codes[table], jpeg_ac_codes[table]);
+                        out->size = w.p - out->data;
+                        if (!ok) return 0;
+                    }
+                }
+            }
+        }
+    }
+    //the last byte is padded with 1 bits
+    if (!(w.p = encoded_reserve(out, 4))) return 0;
+    if (w.count > 0) put_bits(&w, (1 << (8 - w.count)) - 1, 8 - w.count);
+    *w.p++ = 0xff;
+    *w.p++ = 0xd9;
+    out->size = w.p - out->data;
+    return 1;
+}
+
+#ifdef HAVE_IO_URING
+//io_uring instance set up through the raw system calls, one per thread (see thread_ring). Entries are queued
+//with uring_sqe and submitted together by uring_submit, so a batch of opens, reads, writes and closes costs
+//one system call instead of one each
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned queued; //entries filled in since the last submit
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    int direct_files; //the ring has a registered file slot, which uring_write_file needs
+    unsigned owed; //entries the kernel has taken whose completions haven't been taken by uring_cqe
+    int broken; //a submit failed, thread_ring retires the ring and the thread goes back to blocking I/O
+};
+
+//unmaps and closes a ring
+void uring_free(void* ring) {
+    struct uring* r = ring;
+    if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+//sets up a ring with room for entries queued operations, NULL if the kernel doesn't allow io_uring
+struct uring* uring_init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return NULL;
+
+    struct uring* r = calloc(1, sizeof(struct uring));
+    r->fd = fd;
+    r->entries = params.sq_entries;
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    //newer kernels map both rings with one mapping
+    int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cq_ring = single_mmap ? r->sq_ring
+        : mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        uring_free(r);
+        return NULL;
+    }
+    unsigned char* sq = r->sq_ring;
+    unsigned char* cq = r->cq_ring;
+    r->sq_head = (unsigned*)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + params.sq_off.array);
+    r->cq_head = (unsigned*)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    //one empty slot that opens can put their file into, so a write and close linked to the open can refer
+    //to the file before its descriptor is known (kernel 5.15+, writes go through blocking I/O without it)
+    struct io_uring_rsrc_register files = { .nr = 1, .flags = IORING_RSRC_REGISTER_SPARSE };
+    r->direct_files = syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0;
+    return r;
+}
+
+//next free submission entry, cleared, NULL once entries are queued without being submitted
+struct io_uring_sqe* uring_sqe(struct uring* r) {
+    if (r->queued == r->entries) return NULL;
+    unsigned index = (*r->sq_tail + r->queued++) & *r->sq_mask;
+    r->sq_array[index] = index;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//submits the queued entries and waits until wait completions are ready, returns 0 on failure. The entries
+//the kernel hadn't taken by then are withdrawn, the ones it took still complete and have to be collected
+//with uring_drain, and the ring is marked broken
+int uring_submit(struct uring* r, unsigned wait) {
+    unsigned head = *r->sq_head, tail = *r->sq_tail + r->queued;
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    r->queued = 0;
+    for (;;) {
+        unsigned unsubmitted = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        unsigned ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+        if (unsubmitted == 0 && ready >= wait) {
+            r->owed += tail - head;
+            return 1;
+        }
+        if (syscall(__NR_io_uring_enter, r->fd, unsubmitted, wait, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            //without SQPOLL the kernel only reads the tail inside io_uring_enter, so it can be moved back
+            unsigned taken = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+            __atomic_store_n(r->sq_tail, taken, __ATOMIC_RELEASE);
+            r->owed += taken - head;
+            r->broken = 1;
+            return 0;
+        }
+    }
+}
+
+//after a failed submit, waits for the completions of every entry the kernel took and returns how many
+//there are to take with uring_cqe, fewer only if waiting fails as well
+unsigned uring_drain(struct uring* r) {
+    for (;;) {
+        unsigned ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+        if (ready >= r->owed) return r->owed;
+        if (syscall(__NR_io_uring_enter, r->fd, 0, r->owed - ready, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) return ready;
+    }
+}
+
+//takes the next completion, which uring_submit has waited for, returns its result and sets *user_data
+int uring_cqe(struct uring* r, unsigned long long* user_data) {
+    unsigned head = *r->cq_head;
+    const struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+    int res = cqe->res;
+    *user_data = cqe->user_data;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    r->owed--;
+    return res;
+}
+
+//a file read whole through io_uring: uring_open_files sets fd and size, the caller then points data at a
+//buffer of size bytes (or leaves it NULL to skip the file) and uring_read_files fills it and closes the file
+struct uring_file {
+    const char* path;
+    int fd;
+    struct statx info;
+    size_t size; //0 if the file is empty, couldn't be opened or is too large for stbi_load_from_memory
+    unsigned char* data;
+    int ok; //data holds the whole file
+};
+
+//opens up to URING_BATCH files and reads their sizes with one submission
+void uring_open_files(struct uring* r, struct uring_file* files, int count) {
+    for (int i = 0; i < count; i++) {
+        struct uring_file* file = &files[i];
+        file->fd = -1;
+        file->size = 0;
+        file->data = NULL;
+        file->ok = 0;
+        struct io_uring_sqe* open_op = uring_sqe(r);
+        open_op->opcode = IORING_OP_OPENAT;
+        open_op->fd = AT_FDCWD;
+        open_op->addr = (uintptr_t)file->path;
+        open_op->open_flags = O_RDONLY;
+        open_op->user_data = 2 * i;
+        struct io_uring_sqe* stat_op = uring_sqe(r);
+        stat_op->opcode = IORING_OP_STATX;
+        stat_op->fd = AT_FDCWD;
+        stat_op->addr = (uintptr_t)file->path;
+        stat_op->len = STATX_SIZE;
+        stat_op->off = (uintptr_t)&file->info;
+        stat_op->user_data = 2 * i + 1;
+    }
+    if (!uring_submit(r, 2 * count)) {
+        //closes what was opened before the failure, the files are then read with blocking calls
+        for (unsigned k = uring_drain(r); k > 0; k--) {
+            unsigned long long id;
+            int res = uring_cqe(r, &id);
+            if (id % 2 == 0 && res >= 0) close(res);
+        }
+        return;
+    }
+
+    int stat_ok[URING_BATCH] = { 0 };
+    for (int k = 0; k < 2 * count; k++) {
+        unsigned long long id;
+        int res = uring_cqe(r, &id);
+        if (id % 2 == 0) files[id / 2].fd = res >= 0 ? res : -1;
+        else stat_ok[id / 2] = res == 0;
+    }
+    for (int i = 0; i < count; i++) {
+        struct uring_file* file = &files[i];
+        if (file->fd >= 0 && stat_ok[i] && file->info.stx_size <= INT_MAX) file->size = file->info.stx_size;
+    }
+}
+
+//reads the opened files that were given a buffer and closes every opened file with one submission, each
+//close is linked to its file's read so it runs once the read is done
+void uring_read_files(struct uring* r, struct uring_file* files, int count) {
+    unsigned waiting = 0;
+    for (int i = 0; i < count; i++) {
+        struct uring_file* file = &files[i];
+        if (file->fd < 0) continue;
+        if (file->data) {
+            struct io_uring_sqe* read_op = uring_sqe(r);
+            read_op->opcode = IORING_OP_READ;
+            read_op->fd = file->fd;
+            read_op->addr = (uintptr_t)file->data;
+            read_op->len = file->size;
+            read_op->off = 0;
+            read_op->flags = IOSQE_IO_LINK;
+            read_op->user_data = i;
+            waiting++;
+        }
+        struct io_uring_sqe* close_op = uring_sqe(r);
+        close_op->opcode = IORING_OP_CLOSE;
+        close_op->fd = file->fd;
+        close_op->user_data = count + i;
+        waiting++;
+    }
+    if (waiting == 0) return;
+    //after a failed submit, the completions that do arrive are handled as usual, then the files whose close
+    //didn't run are closed here
+    int failed = !uring_submit(r, waiting);
+    if (failed) waiting = uring_drain(r);
+
+    for (unsigned k = 0; k < waiting; k++) {
+        unsigned long long id;
+        int res = uring_cqe(r, &id);
+        if (id < (unsigned)count) files[id].ok = res >= 0 && (size_t)res == files[id].size;
+        else {
+            //a failed or short read cancels the linked close
+            struct uring_file* file = &files[id - count];
+            if (res == -ECANCELED) close(file->fd);
+            file->fd = -1;
+        }
+    }
+    for (int i = 0; failed && i < count; i++) {
+        if (files[i].fd >= 0) close(files[i].fd);
+        files[i].fd = -1;
+    }
+}
+
+//decodes a file read with one open and stat submission and one read and close submission, instead of
+//stbi_load's stdio calls. Files that can't be read this way go through stbi_load
+unsigned char* uring_load(struct uring* r, const char* path, int* width, int* height, int* channels) {
+    struct uring_file file = { .path = path };
+    uring_open_files(r, &file, 1);
+    //the file comes from the buffer pool rather than the arena: the decoder allocates from the arena after it,
+    //so the arena could not take it back until the job is done
+    if (file.size > 0) file.data = pool_alloc(file.size);
+    uring_read_files(r, &file, 1);
+    unsigned char* img = file.ok ? stbi_load_from_memory(file.data, (int)file.size, width, height, channels, 0)
+        : stbi_load(path, width, height, channels, 0);
+    if (file.data) pool_free(file.data, file.size);
+    return img;
+}
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image/stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image/stb_image_write.h"
+//creates path and writes size bytes to it with one submission: the open puts the file into the ring's
+//registered slot, and the linked write and close refer to that slot, so nothing waits for the descriptor.
+//If rename_to is set, a rename of the finished file to it is linked after the close
+//returns 0 if any step failed
+int uring_write_file(struct uring* r, const char* path, const char* rename_to, const unsigned char* data, size_t size) {
+    if (!r->direct_files || size > INT_MAX) return 0;
+    struct io_uring_sqe* open_op = uring_sqe(r);
+    open_op->opcode = IORING_OP_OPENAT;
+    open_op->fd = AT_FDCWD;
+    open_op->addr = (uintptr_t)path;
+    open_op->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    open_op->len = 0666;
+    open_op->file_index = 1; //slot 0
+    open_op->flags = IOSQE_IO_LINK;
+    open_op->user_data = 0;
+    struct io_uring_sqe* write_op = uring_sqe(r);
+    write_op->opcode = IORING_OP_WRITE;
+    write_op->fd = 0;
+    write_op->addr = (uintptr_t)data;
+    write_op->len = size;
+    write_op->off = 0;
+    write_op->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    write_op->user_data = 1;
+    struct io_uring_sqe* close_op = uring_sqe(r);
+    close_op->opcode = IORING_OP_CLOSE;
+    close_op->file_index = 1;
+    close_op->user_data = 2;
+    int steps = 3;
+    if (rename_to) {
+        close_op->flags = IOSQE_IO_LINK;
+        struct io_uring_sqe* rename_op = uring_sqe(r);
+        rename_op->opcode = IORING_OP_RENAMEAT;
+        rename_op->fd = AT_FDCWD;
+        rename_op->addr = (uintptr_t)path;
+        rename_op->len = AT_FDCWD;
+        rename_op->addr2 = (uintptr_t)rename_to;
+        rename_op->user_data = 3;
+        steps = 4;
+    }
+    if (!uring_submit(r, steps)) {
+        //the slot is freed along with the ring, which thread_ring retires, and the caller writes the file again
+        for (unsigned k = uring_drain(r); k > 0; k--) {
+            unsigned long long id;
+            uring_cqe(r, &id);
+        }
+        return 0;
+    }
 
-//folder locations
-#define INPUT_FOLDER "image_input/"
-#define OUTPUT_FOLDER "image_output/"
+    int res[4] = { 0 };
+    for (int k = 0; k < steps; k++) {
+        unsigned long long id;
+        int result = uring_cqe(r, &id);
+        res[id] = result;
+    }
+    if (res[0] >= 0 && res[2] == -ECANCELED) {
+        //the write failed or was short, which cancelled the close, the slot still has to be freed
+        close_op = uring_sqe(r);
+        close_op->opcode = IORING_OP_CLOSE;
+        close_op->file_index = 1;
+        unsigned long long id;
+        if (uring_submit(r, 1)) uring_cqe(r, &id);
+    }
+    return res[0] >= 0 && res[1] >= 0 && (size_t)res[1] == size && res[2] >= 0 && res[3] >= 0;
+}
+#else
+//built without the io_uring headers, --io uring falls back to blocking I/O
+struct uring;
+unsigned char* uring_load(struct uring* r, const char* path, int* width, int* height, int* channels) { return NULL; }
+int uring_write_file(struct uring* r, const char* path, const char* rename_to, const unsigned char* data, size_t size) { return 0; }
+#endif
 
-//thread count
-#define NUM_THREADS 16
+//the calling thread's ring, NULL if io_uring is unavailable
+struct uring* thread_ring(void) {
+#ifdef HAVE_IO_URING
+    struct thread_state* t = thread_state();
+    if (t->ring && t->ring->broken) {
+        uring_free(t->ring);
+        t->ring = NULL;
+        t->ring_failed = 1;
+    }
+    if (!t->ring && !t->ring_failed) {
+        t->ring = uring_init(2 * URING_BATCH);
+        t->ring_failed = !t->ring;
+    }
+    return t->ring;
+#else
+    return NULL;
+#endif
+}
 
+//bump allocator for the small allocations made while decoding and encoding one image. Freeing is a no-op unless
+//the allocation is on top of the arena, which can also grow in place, everything else is released at once by
+//arena_release. Allocations of POOL_MIN_SIZE and up are pool buffers instead, so the decoder's large buffers go
+//back to the pool as soon as it frees them
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size, used;
+    _Alignas(16) unsigned char data[];
+};
 
-//1 thread results in serialization
-//n threads where n is the number of images results in each image being worked on but without processing speedups until some threads finish their image while others are still working.
-//>n threads results in right away processing speedups for as many extra threads exist.
+struct arena {
+    struct arena_chunk* chunks; //the one allocated from first, older full ones after it
+    size_t total; //bytes in all chunks
+    struct arena* next_free;
+};
 
+//in front of every allocation, arena is NULL for pool buffers and allocations made outside an image (which use malloc)
+struct arena_header {
+    size_t size;
+    struct arena* arena;
+};
 
-//returns file extension by finding last "." in a string
-char* get_filename_ext(char* filename) {
-    char* dot = strrchr(filename, '.');
-    return (!dot || dot == filename) ? "" : dot + 1;
+//arenas not in use by an image, shared by all threads since images move between pipeline stages
+struct arena* free_arenas = NULL;
+pthread_mutex_t free_arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//bytes an allocation of size takes in a chunk, header included, rounded to keep allocations 16 byte aligned
+static inline size_t arena_span(size_t size) {
+    return sizeof(struct arena_header) + ((size + 15) & ~(size_t)15);
 }
 
-//Grayscale operation takes average of rgb values into a single channel
-void apply_grayscale(unsigned char* img, unsigned char* output_img, int width, int height, int channels, int output_channels) {
-#pragma omp taskloop
-    for (size_t i = 0; i < width * height; ++i) {
-        unsigned char* p = img + i * channels;
-        unsigned char* pg = output_img + i * output_channels;
-        pg[0] = (p[0] + p[1] + p[2]) / 3;
-        if (channels == 4) pg[1] = p[3];
+void* arena_alloc(struct arena* a, size_t size) {
+    size_t span = arena_span(size);
+    struct arena_chunk* c = a->chunks;
+    if (!c || c->size - c->used < span) {
+        //chunks are pool buffers, sized to use all of their size class
+        size_t bytes = c ? 2 * (sizeof(struct arena_chunk) + c->size) : ARENA_CHUNK;
+        if (bytes < sizeof(struct arena_chunk) + span) bytes = sizeof(struct arena_chunk) + span;
+        c = pool_alloc(bytes);
+        if (!c) return NULL;
+        c->next = a->chunks;
+        c->size = pool_size(bytes) - sizeof(struct arena_chunk);
+        c->used = 0;
+        a->chunks = c;
+        a->total += c->size;
     }
+    struct arena_header* h = (struct arena_header*)(c->data + c->used);
+    c->used += span;
+    h->size = size;
+    h->arena = a;
+    return h + 1;
 }
 
-//Apply sepia coefficients to rgb values
-void apply_sepia(unsigned char* img, unsigned char* output_img, int width, int height, int channels) {
-#pragma omp taskloop
-    for (size_t i = 0; i < width * height; ++i) {
-        unsigned char* p = img + i * channels;
-        unsigned char* pg = output_img + i * channels;
-        pg[0] = (uint8_t)fmin(0.393 * p[0] + 0.769 * p[1] + 0.189 * p[2], 255.0);
-        pg[1] = (uint8_t)fmin(0.349 * p[0] + 0.686 * p[1] + 0.168 * p[2], 255.0);
-        pg[2] = (uint8_t)fmin(0.272 * p[0] + 0.534 * p[1] + 0.131 * p[2], 255.0);
-        if (channels == 4) pg[3] = p[3];
+//allocations this large, header included, are pool buffers rather than arena or malloc blocks
+static inline int arena_pooled(size_t size) {
+    return sizeof(struct arena_header) + size >= POOL_MIN_SIZE;
+}
+
+//the allocation at h ends where its arena's current chunk is filled up to
+static inline int arena_on_top(const struct arena* a, const struct arena_header* h) {
+    const struct arena_chunk* c = a->chunks;
+    return (const unsigned char*)h >= c->data && (const unsigned char*)h + arena_span(h->size) == c->data + c->used;
+}
+
+//STBI_MALLOC and STBIW_MALLOC, allocates from the calling thread's current arena, or with malloc if it has none.
+//Large allocations come from the pool either way
+void* arena_malloc(size_t size) {
+    struct arena* a = thread_state()->arena;
+    if (a && !arena_pooled(size)) return arena_alloc(a, size);
+    size_t bytes = sizeof(struct arena_header) + size;
+    struct arena_header* h = arena_pooled(size) ? pool_alloc(bytes) : malloc(bytes);
+    if (!h) return NULL;
+    h->size = size;
+    h->arena = NULL;
+    return h + 1;
+}
+
+//STBI_FREE and STBIW_FREE, freeing the top of an arena makes the allocation below it the top
+void arena_free(void* p) {
+    if (!p) return;
+    struct arena_header* h = (struct arena_header*)p - 1;
+    struct arena* a = h->arena;
+    if (a) {
+        if (arena_on_top(a, h)) a->chunks->used = (unsigned char*)h - a->chunks->data;
     }
+    else if (arena_pooled(h->size)) pool_free(h, sizeof(struct arena_header) + h->size);
+    else free(h);
 }
 
-//Iterate through each row and swap left and right values until meeting in the middle
-void apply_hflip(unsigned char* img, int width, int height, int channels) {
-#pragma omp taskloop
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width / 2; x++) {
-            int left = (y * width + x) * channels;
-            int right = (y * width + (width - x - 1)) * channels;
-            //go through existing channels
-            for (int c = 0; c < channels; c++) {
-                unsigned char tmp = img[left + c];
-                img[left + c] = img[right + c];
-                img[right + c] = tmp;
-            }
+//STBI_REALLOC and STBIW_REALLOC, the top of an arena grows in place while its chunk has room and a pool buffer
+//while it stays in its size class, anything else moves
+void* arena_realloc(void* p, size_t size) {
+    if (!p) return arena_malloc(size);
+    struct arena_header* h = (struct arena_header*)p - 1;
+    struct arena* a = h->arena;
+    size_t old_size = h->size;
+    if (a && !arena_pooled(size) && arena_on_top(a, h)) {
+        struct arena_chunk* c = a->chunks;
+        size_t start = (unsigned char*)h - c->data;
+        if (c->size - start >= arena_span(size)) {
+            c->used = start + arena_span(size);
+            h->size = size;
+            return p;
         }
     }
+    if (!a && arena_pooled(old_size) && arena_pooled(size)
+        && pool_class(sizeof(struct arena_header) + size) == pool_class(sizeof(struct arena_header) + old_size)) {
+        h->size = size;
+        return p;
+    }
+    if (!a && !arena_pooled(old_size) && !arena_pooled(size)) {
+        h = realloc(h, sizeof(struct arena_header) + size);
+        if (!h) return NULL;
+        h->size = size;
+        return h + 1;
+    }
+    void* moved = arena_malloc(size);
+    if (!moved) return NULL;
+    memcpy(moved, p, old_size < size ? old_size : size);
+    arena_free(p);
+    return moved;
 }
 
-//Iterate through each row and swap left and right values until meeting in the middle
-void apply_vflip(unsigned char* img, int width, int height, int channels) {
-    unsigned char* flipped = malloc(width * height * channels);
-#pragma omp taskloop
-    for (int y = 0; y < height; y++) {
-        int src_y = height - y - 1;
-        memcpy(flipped + y * width * channels, img + src_y * width * channels, width * channels);
+//whether an allocation from arena_malloc is arena space, which only goes away with its arena
+int arena_holds(const void* p) {
+    return p && ((const struct arena_header*)p - 1)->arena != NULL;
+}
+
+//an empty arena for a new image
+struct arena* arena_acquire(void) {
+    pthread_mutex_lock(&free_arenas_lock);
+    struct arena* a = free_arenas;
+    if (a) free_arenas = a->next_free;
+    pthread_mutex_unlock(&free_arenas_lock);
+    return a ? a : calloc(1, sizeof(struct arena));
+}
+
+//empties an arena once its image is written. An arena that needed several chunks is merged into one chunk of
+//their total size, so the next image of that size fits without allocating, unless that is over ARENA_BYTES
+void arena_release(struct arena* a) {
+    if (a->chunks && (a->chunks->next || a->total > ARENA_BYTES)) {
+        while (a->chunks) {
+            struct arena_chunk* next = a->chunks->next;
+            pool_free(a->chunks, sizeof(struct arena_chunk) + a->chunks->size);
+            a->chunks = next;
+        }
+        size_t bytes = sizeof(struct arena_chunk) + a->total;
+        if (a->total <= ARENA_BYTES && (a->chunks = pool_alloc(bytes)) != NULL) {
+            a->chunks->next = NULL;
+            a->chunks->size = a->total = pool_size(bytes) - sizeof(struct arena_chunk);
+        }
+        else a->total = 0;
     }
-    //move flipped to img
-    memcpy(img, flipped, width * height * channels);
-    free(flipped);
+    if (a->chunks) a->chunks->used = 0;
+    pthread_mutex_lock(&free_arenas_lock);
+    a->next_free = free_arenas;
+    free_arenas = a;
+    pthread_mutex_unlock(&free_arenas_lock);
 }
 
-//Rotates image using transpose and flipping depending on rotation (90: t, hflip; 180: hflip, vflip; 270: t, vflip;)
-void apply_rotate(unsigned char* img, int width, int height, int channels, int rotation) {
+//next image to work on as a new job, NULL once there are none left, any thread can call it
+struct image_job* next_job(struct job_source* source) {
+    if (source->queue) return queue_pop(source->queue);
+    int i;
+#pragma omp atomic capture
+    i = source->next_file++;
+    if (i >= source->file_count) return NULL;
+    struct image_job* job = calloc(1, sizeof(struct image_job));
+    job->filename = source->entries[i].filename;
+    job->entry = &source->entries[i];
+    return job;
+}
 
-    switch (rotation) {
-    case 180: //180 reuses flip functions
-        apply_hflip(img, width, height, channels);
-        apply_vflip(img, width, height, channels);
-        break;
-    
-    case 90: //90 & 270 rotation requires transposing the image
-    case 270: {
-        
-        unsigned char* transposed = malloc(width * height * channels);
-        if (!transposed) {
-            fprintf(stderr, "Memory allocation failed\n");
-            return;
-        }
-        // Tile based transpose
-        const int TILE_SIZE = 64;
-#pragma omp taskloop
-        for (int tile_y = 0; tile_y < height; tile_y += TILE_SIZE) {
-            for (int tile_x = 0; tile_x < width; tile_x += TILE_SIZE) {
-                //Process each tile
-                int y_end = (tile_y + TILE_SIZE < height) ? tile_y + TILE_SIZE : height;
-                int x_end = (tile_x + TILE_SIZE < width) ? tile_x + TILE_SIZE : width;
-
-                for (int y = tile_y; y < y_end; y++) {
-                    for (int x = tile_x; x < x_end; x++) {
-                        //get source and destination positions
-                        int src_idx = channels * (y * width + x);
-                        int dst_idx = channels * (x * height + y);
-
-                        //copy all channels
-                        for (int c = 0; c < channels; c++) {
-                            transposed[dst_idx + c] = img[src_idx + c];
-                        }
-                    }
-                }
+//hands the job's arena on to another image once nothing in it is needed any more
+void release_job_arena(struct image_job* job) {
+    if (job->arena) arena_release(job->arena);
+    job->arena = NULL;
+}
+
+//records the time a job took and frees it along with its arena
+void finish_job(struct job_source* source, struct image_job* job) {
+    release_job_arena(job);
+    if (job->entry) job->entry->actual = job->seconds;
+    else {
+#pragma omp atomic
+        source->seconds += job->seconds;
+#pragma omp atomic
+        source->finished++;
+    }
+    free(job);
+}
+
+//creates path and writes size bytes to it, with one write unless the kernel takes less, returns 0 on failure
+int write_file(const char* path, const unsigned char* data, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return 0;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return close(fd) == 0 && done == size;
+}
+
+//writes an encoded output file, through io_uring when enabled and otherwise with write_file
+//with atomic output the data goes to a temporary file next to path that is renamed over it once complete,
+//so path never holds a partly written image. Returns 0 on failure
+int write_output(const char* path, const unsigned char* data, size_t size) {
+    char temp[PATH_MAX + 32];
+    const char* target = path;
+    if (settings.atomic_output) {
+        if (snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(temp)) return 0;
+        target = temp;
+    }
+    const char* rename_to = target != path ? path : NULL;
+    struct uring* ring = settings.io_uring ? thread_ring() : NULL;
+    if (ring && uring_write_file(ring, target, rename_to, data, size)) return 1;
+    if (write_file(target, data, size) && (!rename_to || rename(target, path) == 0)) return 1;
+    if (rename_to) unlink(target);
+    return 0;
+}
+
+//takes size more bytes of the read-ahead budget, waiting until they fit unless wait is 0, in which case it returns 0
+//instead. A file larger than the whole budget is let through alone
+int prefetch_reserve(struct prefetcher* p, size_t size, int wait) {
+    pthread_mutex_lock(&p->lock);
+    int fits;
+    while (!(fits = p->used == 0 || p->used + size <= p->budget) && wait) pthread_cond_wait(&p->released, &p->lock);
+    if (fits) p->used += size;
+    pthread_mutex_unlock(&p->lock);
+    return fits;
+}
+
+//frees a job's read-ahead bytes and returns them to the budget
+void release_prefetched(struct image_job* job) {
+    struct prefetcher* p = job->prefetcher;
+    if (!p) return;
+    pool_free(job->data, job->data_size);
+    pthread_mutex_lock(&p->lock);
+    p->used -= job->data_size;
+    pthread_cond_broadcast(&p->released);
+    pthread_mutex_unlock(&p->lock);
+    job->data = NULL;
+    job->data_size = 0;
+    job->prefetcher = NULL;
+}
+
+//reads a job's whole file into job->data, which is left unset if the file can't be read (the loader then reports it)
+void prefetch_file(struct prefetcher* p, struct image_job* job) {
+    char path[PATH_MAX];
+    if (!input_path(path, sizeof(path), job->filename)) return;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0 || info.st_size > INT_MAX) {
+        close(fd);
+        return;
+    }
+    //the kernel starts fetching the file while this thread may still be waiting for budget
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    prefetch_reserve(p, info.st_size, 1);
+    job->prefetcher = p;
+    job->data_size = info.st_size;
+    job->data = pool_alloc(job->data_size);
+    size_t done = 0;
+    while (job->data && done < job->data_size) {
+        ssize_t n = read(fd, job->data + done, job->data_size - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    close(fd);
+    if (done < job->data_size) release_prefetched(job);
+}
+
+#ifdef HAVE_IO_URING
+//reads the opened files of a batch that were given a buffer, closes the rest and hands the jobs on
+void prefetch_read(struct prefetcher* p, struct uring* r, struct image_job** jobs, struct uring_file* files, int count) {
+    uring_read_files(r, files, count);
+    for (int i = 0; i < count; i++) {
+        if (!files[i].ok) release_prefetched(jobs[i]);
+        queue_push(&p->ready, jobs[i]);
+    }
+}
+
+//io_uring read-ahead: claims up to URING_BATCH files at a time, opens and sizes them with one submission and
+//reads them with another. Files are read as soon as the next one doesn't fit the budget, since the budget
+//is only freed by jobs that have been handed on
+void prefetch_batches(struct prefetcher* p, struct uring* r) {
+    struct image_job* jobs[URING_BATCH];
+    struct uring_file files[URING_BATCH];
+    char (*paths)[PATH_MAX] = malloc(URING_BATCH * sizeof(*paths));
+    int batch = settings.prefetch_files < URING_BATCH ? settings.prefetch_files : URING_BATCH;
+    for (;;) {
+        int count = 0;
+        while (count < batch && (jobs[count] = next_job(p->files)) != NULL) {
+            //a path too long is handed on unread, the loader reports it
+            if (!input_path(paths[count], sizeof(*paths), jobs[count]->filename)) {
+                queue_push(&p->ready, jobs[count]);
+                continue;
             }
+            files[count].path = paths[count];
+            count++;
         }
+        if (count == 0) break;
 
-        // Apply flip based on rotation direction
-        if (rotation == 90) {
-            apply_hflip(transposed, height, width, channels);
+        //a batch whose open failed is handed on unread, the later files are read without the ring
+        uring_open_files(r, files, count);
+        int first = 0;
+        for (int i = 0; i < count; i++) {
+            if (files[i].size == 0) continue;
+            if (!prefetch_reserve(p, files[i].size, 0)) {
+                prefetch_read(p, r, jobs + first, files + first, i - first);
+                first = i;
+                prefetch_reserve(p, files[i].size, 1);
+            }
+            jobs[i]->prefetcher = p;
+            jobs[i]->data_size = files[i].size;
+            jobs[i]->data = files[i].data = pool_alloc(files[i].size);
         }
-        else {
-            apply_vflip(transposed, height, width, channels);
+        prefetch_read(p, r, jobs + first, files + first, count - first);
+        if (r->broken) break;
+    }
+    free(paths);
+}
+#endif
+
+//read-ahead thread, takes files in processing order and hands them on once they are in memory
+void* prefetch_files(void* prefetcher) {
+    struct prefetcher* p = prefetcher;
+#ifdef HAVE_IO_URING
+    struct uring* r = settings.io_uring ? thread_ring() : NULL;
+    if (r) prefetch_batches(p, r);
+#endif
+    struct image_job* job;
+    while ((job = next_job(p->files)) != NULL) {
+        prefetch_file(p, job);
+        queue_push(&p->ready, job);
+    }
+    queue_producer_done(&p->ready);
+    return NULL;
+}
+
+//starts reading ahead from files, the run then takes its jobs from p->output
+void prefetch_start(struct prefetcher* p, struct job_source* files) {
+    p->files = files;
+    p->output = (struct job_source){ .queue = &p->ready };
+    p->budget = settings.prefetch_bytes;
+    p->used = 0;
+    p->thread_count = settings.prefetch_threads;
+    queue_init(&p->ready, settings.prefetch_files, p->thread_count);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->released, NULL);
+    p->threads = malloc(p->thread_count * sizeof(pthread_t));
+    for (int i = 0; i < p->thread_count; i++) pthread_create(&p->threads[i], NULL, prefetch_files, p);
+}
+
+//waits for the read-ahead threads, which are done once the run has taken every job
+void prefetch_stop(struct prefetcher* p) {
+    for (int i = 0; i < p->thread_count; i++) pthread_join(p->threads[i], NULL);
+    free(p->threads);
+    queue_destroy(&p->ready);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->released);
+}
+
+//flips and rotates a jpeg into a jpeg without decoding it (see write_transformed_jpeg), when the operations are only
+//flips and rotations: no generation loss is added and the inverse DCT, color conversion, upsampling and forward DCT
+//are skipped. Returns 1 once the job is done, or 0, leaving it for load_image, if the file isn't an 8-bit greyscale
+//or YCbCr jpeg or a mirrored edge isn't a whole number of MCUs
+int transform_jpeg(struct image_job* job, const struct operations* ops) {
+    if (!settings.lossless_jpeg) return 0;
+    char* ext = get_filename_ext(job->filename);
+    if (strcmp(ext, "jpg") != 0 && strcmp(ext, "jpeg") != 0) return 0;
+    struct process_plan plan;
+    plan_operations(&plan, ops, 3);
+    if (plan.color != COLOR_NONE) return 0;
+    double start = omp_get_wtime();
+
+    //read ahead contents or a mapping of the file, like load_mapped. Paths too long are left for load_image to report
+    char path[PATH_MAX], out_path[PATH_MAX];
+    if (!input_path(path, sizeof(path), job->filename) || !join_path(out_path, sizeof(out_path), settings.output_folder, job->filename)) return 0;
+    const unsigned char* data = job->data;
+    size_t size = job->data_size;
+    void* mapped = MAP_FAILED;
+    if (!data) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return 0;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0 && info.st_size <= INT_MAX) {
+            mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
         }
+        close(fd);
+        if (mapped == MAP_FAILED) return 0;
+        madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+        data = mapped;
+        size = info.st_size;
+    }
 
-        memcpy(img, transposed, width * height * channels);
-        free(transposed);
-        break;
+    printf("(%d): transforming (%s) in the DCT domain...\n", omp_get_thread_num(), job->filename);
+    struct thread_state* t = thread_state();
+    struct encoded* out = &t->output;
+    out->size = 0;
+    out->failed = 0;
+    if (!job->arena) job->arena = arena_acquire();
+    t->arena = job->arena;
+    stbi__context s;
+    stbi__start_mem(&s, data, (int)size);
+    stbi__jpeg* z = STBI_MALLOC(sizeof(stbi__jpeg));
+    int ok = 0;
+    if (z) {
+        memset(z, 0, sizeof(*z));
+        z->s = &s;
+        stbi__setup_jpeg(z);
+        //4 component (CMYK/YCCK) and RGB files (Adobe or with component ids 'R', 'G', 'B') would need their color
+        //markers carried over, the output's JFIF marker declares YCbCr
+        ok = jpeg_read_coefficients(z) && (s.img_n == 1 || (s.img_n == 3 && z->rgb != 3 && (z->app14_color_transform != 0 || z->jfif)))
+            && write_transformed_jpeg(z, &plan.transform, out);
+        stbi__cleanup_jpeg(z);
+        STBI_FREE(z);
+    }
+    t->arena = NULL;
+    release_job_arena(job);
+    if (mapped != MAP_FAILED) munmap(mapped, size);
+    if (!ok) {
+        job->seconds += omp_get_wtime() - start;
+        printf("(%d): \tdecoding (%s) instead\n", omp_get_thread_num(), job->filename);
+        return 0;
     }
+    release_prefetched(job);
 
-    default:
-        fprintf(stderr, "ERROR: Invalid rotation value (%d). Valid values are 90, 180, 270\n", rotation);
+    make_parent_folders(out_path);
+    if (write_output(out_path, out->data, out->size)) printf("(%d): \t\t\tWRITTEN: (%s)\n", omp_get_thread_num(), out_path);
+    else printf("(%d): \t\t\tFailed to write %s\n", omp_get_thread_num(), out_path);
+    job->seconds += omp_get_wtime() - start;
+    return 1;
+}
+
+//loads image from the input folder, returns 0 on failure
+int load_image(struct image_job* job) {
+    int threadId = omp_get_thread_num();
+    double start = omp_get_wtime();
+
+    //get path for given image, the job is skipped if it or its output path doesn't fit
+    char path[PATH_MAX], out_path[PATH_MAX];
+    if (!input_path(path, sizeof(path), job->filename) || !join_path(out_path, sizeof(out_path), settings.output_folder, job->filename)) {
+        printf("(%d): Failed to load %s: path too long\n", threadId, job->filename);
+        release_prefetched(job);
+        return 0;
+    }
+
+    //load image
+    printf("(%d): loading (%s)...\n", threadId, job->filename);
+    struct image_buffer* image = &job->image;
+    struct thread_state* t = thread_state();
+    struct uring* ring = settings.io_uring ? thread_ring() : NULL;
+    if (!job->arena) job->arena = arena_acquire();
+    t->arena = job->arena;
+    if (job->data) {
+        image->pixels = stbi_load_from_memory(job->data, (int)job->data_size, &image->width, &image->height, &image->channels, 0);
+        release_prefetched(job);
+    }
+    else if (settings.mmap_input) image->pixels = load_mapped(path, &image->width, &image->height, &image->channels);
+    else if (ring) image->pixels = uring_load(ring, path, &image->width, &image->height, &image->channels);
+    else image->pixels = stbi_load(path, &image->width, &image->height, &image->channels, 0);
+    t->arena = NULL;
+    //the decoder has freed its working set, so unless the pixels are arena space themselves (images under
+    //POOL_MIN_SIZE bytes) the arena goes to another image before this one waits in a queue
+    if (!arena_holds(image->pixels)) release_job_arena(job);
+    job->from_stbi = 1;
+    job->seconds += omp_get_wtime() - start;
+    if (!image->pixels) {
+        printf("(%d): Failed to load %s\n", threadId, job->filename);
+        return 0;
+    }
+    printf("(%d): \tLOADED (%s)\n", threadId, job->filename);
+    return 1;
+}
+
+//applies selected operations, job->image is left holding the result, returns 0 (with the image released) on failure
+int process_image(struct image_job* job, const struct operations* ops) {
+    //Start Processing
+    printf("(%d): \tprocessing (%s)...\n", omp_get_thread_num(), job->filename);
+    double start; double end;
+    start = omp_get_wtime();
+
+    //color operation, flips and rotation are fused into one pass that reads the source once
+    //and writes the final image once, in place when the plan allows it
+    struct process_plan plan;
+    plan_operations(&plan, ops, job->image.channels);
+    struct image_buffer result = { NULL };
+    int ok = apply_plan(&plan, &job->image, &result);
+    if (ok && result.pixels != job->image.pixels) {
+        //the plan returned a new buffer, the source is no longer needed
+        release_image(job);
+        job->from_stbi = 0;
+    }
+    if (ok) job->image = result;
+    else release_image(job);
+
+    //Processing Timer End
+    end = omp_get_wtime();
+    job->seconds += end - start;
+    if (ok) printf("(%d): \t\tPROCESSED (%s) in %f seconds\n", omp_get_thread_num(), job->filename, end - start);
+    else printf("(%d): \t\tFailed to process %s\n", omp_get_thread_num(), job->filename);
+    return ok;
+}
+
+//writes processed image to the output folder and releases its buffer
+void write_image(struct image_job* job) {
+    double start = omp_get_wtime();
+    const struct image_buffer* image = &job->image;
+
+    //get output file path
+    char out_path[PATH_MAX];
+    if (!join_path(out_path, sizeof(out_path), settings.output_folder, job->filename)) {
+        printf("(%d): \t\t\tFailed to write %s: path too long\n", omp_get_thread_num(), job->filename);
+        release_image(job);
+        job->seconds += omp_get_wtime() - start;
         return;
     }
+    make_parent_folders(out_path);
+    char* ext = get_filename_ext(job->filename);
+
+    //Writing to correct filetype (PNG and JPG supported)
+    //the file is encoded into the thread's reusable buffer and written out in one go
+    printf("(%d): \t\tWriting: (%s)...\n", omp_get_thread_num(), job->filename);
+    struct thread_state* t = thread_state();
+    struct encoded* out = &t->output;
+    out->size = 0;
+    out->failed = 0;
+    if (!job->arena) job->arena = arena_acquire();
+    t->arena = job->arena;
+    int encoded = encode_image(image, ext, out);
+    t->arena = NULL;
+    if (encoded && write_output(out_path, out->data, out->size)) {
+        printf("(%d): \t\t\tWRITTEN: (%s)\n", omp_get_thread_num(), out_path);
+    }
+    else printf("(%d): \t\t\tFailed to write %s\n", omp_get_thread_num(), out_path);
+
+    release_image(job);
+    job->seconds += omp_get_wtime() - start;
 }
 
 
-int main(int argc, char* argv[]) {
-    //Input Validation: filenames are provided.
-    if (argc < 2) {
-        printf("Error: Provide image filenames.\n");
-        return 0;
+//reads only the image headers to estimate each file's cost
+void scan_files(struct file_entry* entries, char** files, int file_count) {
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < file_count; i++) {
+        char path[PATH_MAX];
+        int width, height, channels;
+        entries[i].filename = files[i];
+        entries[i].actual = 0;
+        entries[i].est_cost = input_path(path, sizeof(path), files[i]) && stbi_info(path, &width, &height, &channels)
+            ? (size_t)width * height * channels : 0;
     }
-    
-    //input sequence
+}
+
+//largest estimated cost first
+int compare_cost_desc(const void* a, const void* b) {
+    size_t ca = ((const struct file_entry*)a)->est_cost, cb = ((const struct file_entry*)b)->est_cost;
+    return (ca < cb) - (ca > cb);
+}
+
+//images the writer supports
+int is_image_file(const char* filename) {
+    const char* ext = get_filename_ext((char*)filename);
+    return strcmp(ext, "png") == 0 || strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0;
+}
+
+//pushes a job for every image under the input folder's subfolder relative ("" for the folder itself)
+//only the open directory handles of the current path are held, so memory does not grow with the file count
+void discover_folder(struct job_queue* discovered, const char* relative) {
+    char path[PATH_MAX];
+    DIR* dir = join_path(path, sizeof(path), settings.input_folder, relative) ? opendir(path) : NULL;
+    if (!dir) {
+        printf("Failed to open folder %s\n", path);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char name[PATH_MAX];
+        struct stat info;
+        if (!join_path(name, sizeof(name), relative, entry->d_name) || !join_path(path, sizeof(path), settings.input_folder, name)) {
+            printf("Skipping %s/%s: path too long\n", relative, entry->d_name);
+            continue;
+        }
+        if (lstat(path, &info) != 0) continue;
+        //links to files are followed, links to folders are not: one pointing back up the tree would repeat the walk
+        if (S_ISLNK(info.st_mode) && (stat(path, &info) != 0 || S_ISDIR(info.st_mode))) continue;
+        if (S_ISDIR(info.st_mode)) discover_folder(discovered, name);
+        else if (S_ISREG(info.st_mode) && is_image_file(name)) {
+            //the job and its file name are one allocation, freed together by finish_job
+            size_t size = strlen(name) + 1;
+            struct image_job* job = calloc(1, sizeof(struct image_job) + size);
+            job->filename = (char*)(job + 1);
+            memcpy(job->filename, name, size);
+            queue_push(discovered, job);
+        }
+    }
+    closedir(dir);
+}
+
+//producer thread for recursive input, the queue is closed once the walk is done
+void* discover_files(void* discovered) {
+    discover_folder(discovered, "");
+    queue_producer_done(discovered);
+    return NULL;
+}
+
+//estimated vs actual cost, predicted times come from the average throughput of the whole batch
+void print_cost_summary(struct file_entry* entries, int file_count) {
+    double total_cost = 0, total_actual = 0;
+    for (int i = 0; i < file_count; i++) {
+        total_cost += entries[i].est_cost;
+        total_actual += entries[i].actual;
+    }
+    if (total_cost == 0) return;
+    double seconds_per_byte = total_actual / total_cost;
+
+    printf("Estimated cost: %.1f MB of pixels, actual: %f thread-seconds (%.1f MB/s per thread)\n",
+        total_cost / 1e6, total_actual, total_actual > 0 ? total_cost / 1e6 / total_actual : 0.0);
+    //entries are sorted, so the first few are the images that decide the batch tail
+    int shown = file_count < 5 ? file_count : 5;
+    for (int i = 0; i < shown; i++) {
+        printf("\t%s: estimated %.1f MB -> %f seconds, actual %f seconds\n", entries[i].filename,
+            entries[i].est_cost / 1e6, entries[i].est_cost * seconds_per_byte, entries[i].actual);
+    }
+}
+
+
+void print_operations(const struct operations* ops) {
+    printf("Chosen: gs(%d), sp(%d), hf(%d), vf(%d), rt(%d):%d, sw(%d), sat(%g), hue(%g), tn(%d), br(%g)\n", ops->greyscale, ops->sepia,
+        ops->hflip, ops->vflip, ops->rotate, ops->rotation, ops->swap, ops->saturation, ops->hue, ops->tint, ops->brightness);
+    if (ops->ordered) printf("Applied in the order listed in --ops\n");
+}
+
+//input sequence, toggles operations until "confirm" is typed
+void read_operations(struct operations* ops) {
     char input[16];
     printf("Select operations (\"confirm\" to proceed):\nNote: Greyscale and Sepia are mutually exclusive.\nNote: Using rotate asks you to type a multiple of 90 degrees. Anything else cancels.\n"); 
     printf("Greyscale: \"gs\"\nSepia: \"sp\"\nHorizontal Flip: \"hf\"\nVertical Flip: \"vf\"\n");
     printf("Rotate n*90 degrees: \"rt\" then \"90\", \"180\", or \"270\"\n");
-    
-    //Operation bools
-    int greyscale = 0, hflip = 0, vflip = 0, sepia = 0, rotate = 0, rotation = 0;
+    printf("Swap red/blue: \"sw\"\nSaturation: \"sat\" then a factor (1 = unchanged)\nHue rotation: \"hue\" then degrees\n");
+    printf("Tint: \"tn\" then a hex color like \"ffc080\"\nBrightness: \"br\" then an offset from -255 to 255\n");
 
     //While input not "confirm", modify operation values
-    while (scanf("%s", input) && strcmp(input, "confirm") != 0) {
+    while (scanf("%15s", input) == 1 && strcmp(input, "confirm") != 0) {
         if (strcmp(input, "gs") == 0) {
-            greyscale = !greyscale;
-            if (greyscale) sepia = 0;
+            ops->greyscale = !ops->greyscale;
+            if (ops->greyscale) ops->sepia = 0;
         }
         else if (strcmp(input, "sp") == 0) {
-            sepia = !sepia;
-            if (sepia) greyscale = 0;
+            ops->sepia = !ops->sepia;
+            if (ops->sepia) ops->greyscale = 0;
+        }
+        else if (strcmp(input, "sw") == 0) ops->swap = !ops->swap;
+        //color matrix values, anything unreadable resets the operation
+        else if (strcmp(input, "sat") == 0) {
+            if (scanf("%f", &ops->saturation) != 1) ops->saturation = 1;
+        }
+        else if (strcmp(input, "hue") == 0) {
+            if (scanf("%f", &ops->hue) != 1) ops->hue = 0;
+        }
+        else if (strcmp(input, "br") == 0) {
+            if (scanf("%f", &ops->brightness) != 1) ops->brightness = 0;
+        }
+        else if (strcmp(input, "tn") == 0) {
+            unsigned int color = 0xffffff;
+            ops->tint = scanf("%6x", &color) == 1;
+            ops->tint_color[0] = color >> 16;
+            ops->tint_color[1] = color >> 8;
+            ops->tint_color[2] = color;
         }
-        else if (strcmp(input, "hf") == 0) hflip = !hflip;
-        else if (strcmp(input, "vf") == 0) vflip = !vflip;
+        else if (strcmp(input, "hf") == 0) ops->hflip = !ops->hflip;
+        else if (strcmp(input, "vf") == 0) ops->vflip = !ops->vflip;
         //rotation sequence
         else if (strcmp(input, "rt") == 0) {
             printf("Choose Available Rotation: (90), (180), (270)\n");
-            rotate = !rotate;
-            scanf("%s", input);
+            ops->rotate = !ops->rotate;
+            if (scanf("%15s", input) != 1) input[0] = '\0';
             if (strcmp(input, "90") == 0) {
-                rotation = 90;
-                printf("Rotation: (%d) \n", rotation);
+                ops->rotation = 90;
+                printf("Rotation: (%d) \n", ops->rotation);
             } 
             else if (strcmp(input, "180") == 0) {
-                rotation = 180;
-                printf("Rotation: (%d) \n", rotation);
+                ops->rotation = 180;
+                printf("Rotation: (%d) \n", ops->rotation);
             }
             else if (strcmp(input, "270") == 0) {
-                rotation = 270;
-                printf("Rotation: (%d) \n", rotation);
+                ops->rotation = 270;
+                printf("Rotation: (%d) \n", ops->rotation);
             }
             else {
                 //cancels rotation
-                rotate = !rotate;
-                rotation = 0;
+                ops->rotate = !ops->rotate;
+                ops->rotation = 0;
                 printf("Rotation Cancelled\n");
 
             }
 
         }
         else printf("Invalid operation.\n");
-        printf("Chosen: gs(%d), sp(%d), hf(%d), vf(%d), rt(%d):%d\n", greyscale, sepia, hflip, vflip, rotate, rotation);
+        print_operations(ops);
     }
+}
 
-    //start total timer after input
-    double input_start = omp_get_wtime();
 
+//adds one --ops entry to the chain, returns 0 (after printing why) if it is not a valid operation or
+//can't be applied where it is listed, which is a color operation after greyscale
+//entries match the interactive commands, with values after "=" (sat=1.5, hue=90, tn=ffc080, br=-20) and
+//the rotation appended (rt90, rt180, rt270)
+int parse_operation(struct operations* ops, const char* token) {
+    float value;
+    unsigned int color;
+    int rotation;
+    char extra;
+    struct color_matrix op;
+    if (strcmp(token, "gs") == 0) {
+        ops->greyscale = 1;
+        return 1;
+    }
+    if (strcmp(token, "hf") == 0) {
+        ops->hflip = 1;
+        transform_then(&ops->transform, HFLIP_MATRIX);
+        return 1;
+    }
+    if (strcmp(token, "vf") == 0) {
+        ops->vflip = 1;
+        transform_then(&ops->transform, VFLIP_MATRIX);
+        return 1;
+    }
+    if (sscanf(token, "rt%d%c", &rotation, &extra) == 1 && (rotation == 90 || rotation == 180 || rotation == 270)) {
+        ops->rotate = 1;
+        ops->rotation = rotation;
+        for (int r = 0; r < rotation; r += 90) transform_then(&ops->transform, ROTATE90_MATRIX);
+        return 1;
+    }
+
+    if (strcmp(token, "sp") == 0) {
+        ops->sepia = 1;
+        op = SEPIA_MATRIX;
+    }
+    else if (strcmp(token, "sw") == 0) {
+        ops->swap = 1;
+        op = SWAP_MATRIX;
+    }
+    else if (sscanf(token, "sat=%f%c", &value, &extra) == 1 && isfinite(value)) {
+        ops->saturation = value;
+        op = saturation_matrix(value);
+    }
+    else if (sscanf(token, "hue=%f%c", &value, &extra) == 1 && isfinite(value)) {
+        ops->hue = value;
+        op = hue_matrix(value);
+    }
+    else if (sscanf(token, "br=%f%c", &value, &extra) == 1 && isfinite(value)) {
+        ops->brightness = value;
+        op = brightness_matrix(value);
+    }
+    else if (sscanf(token, "tn=%6x%c", &color, &extra) == 1) {
+        ops->tint = 1;
+        ops->tint_color[0] = color >> 16;
+        ops->tint_color[1] = color >> 8;
+        ops->tint_color[2] = color;
+        op = tint_matrix(ops->tint_color);
+    }
+    else {
+        printf("Error: Invalid operation \"%s\".\n", token);
+        return 0;
+    }
+    //greyscale leaves one channel, so color operations have to come before it
+    if (ops->greyscale) {
+        printf("Error: \"%s\" is listed after gs, color operations have to come before greyscale.\n", token);
+        return 0;
+    }
+    color_matrix_then(&ops->matrix, &op);
+    return 1;
+}
+
+//applies every operation of a comma separated --ops list in order, returns 0 on the first invalid one
+//repeated --ops flags continue the same chain
+int parse_operations(struct operations* ops, const char* list) {
+    if (!ops->ordered) {
+        ops->ordered = 1;
+        ops->transform = (struct transform){ { { 1, 0 }, { 0, 1 } } };
+        ops->matrix = IDENTITY_COLOR_MATRIX;
+    }
+    while (*list) {
+        char token[32];
+        size_t n = strcspn(list, ",");
+        if (n >= sizeof(token)) {
+            printf("Error: Invalid operation \"%.*s...\", entries are at most %d characters.\n", (int)sizeof(token) - 1, list, (int)sizeof(token) - 1);
+            return 0;
+        }
+        memcpy(token, list, n);
+        token[n] = '\0';
+        list += n;
+        if (*list == ',') list++;
+        if (n > 0 && !parse_operation(ops, token)) return 0;
+    }
+    return 1;
+}
 
+void print_usage(const char* program) {
+    printf("Usage: %s [options] file...\n       %s [options] --recursive\n", program, program);
+    printf("Without --ops the operations are read interactively.\n");
+    printf("  --ops LIST             comma separated operations: gs, sp, hf, vf, rt90, rt180, rt270, sw,\n");
+    printf("                         sat=FACTOR, hue=DEGREES, tn=RRGGBB, br=OFFSET (e.g. --ops gs,rt90,hf)\n");
+    printf("  --gray MODE            greyscale formula: average, bt601 or bt709\n");
+    printf("  -i, --input DIR        input folder (default %s)\n", INPUT_FOLDER);
+    printf("  -o, --output DIR       output folder (default %s)\n", OUTPUT_FOLDER);
+    printf("  -t, --threads N        threads in batch mode (default %d)\n", NUM_THREADS);
+    printf("  --mode batch|pipeline  run mode (default %s)\n", PIPELINE_MODE ? "pipeline" : "batch");
+    printf("  --load-threads N       pipeline loader threads (default %d)\n", LOAD_THREADS);
+    printf("  --process-threads N    pipeline processing threads (default %d)\n", PROCESS_THREADS);
+    printf("  --write-threads N      pipeline writer threads (default %d)\n", WRITE_THREADS);
+    printf("  --queue-depth N        max images waiting between pipeline stages (default %d)\n", QUEUE_DEPTH);
+    printf("  --read mmap|stdio      decode inputs from a memory mapping or through stdio reads (default %s)\n", MMAP_INPUT ? "mmap" : "stdio");
+    printf("  --prefetch N           read up to N upcoming files into memory ahead of decoding (default %d, 0 is off)\n", PREFETCH_FILES);
+    printf("  --prefetch-threads N   threads reading ahead (default %d)\n", PREFETCH_THREADS);
+    printf("  --prefetch-mb N        memory the read-ahead files may take (default %ld)\n", PREFETCH_BYTES / (1024 * 1024));
+    printf("  --io uring|blocking    batch file opens, reads, writes and closes through io_uring (default %s)\n", IO_URING ? "uring" : "blocking");
+    printf("  --atomic               write each output to a temporary file and rename it into place once complete\n");
+    printf("  --huge-pages           back large image buffers with transparent huge pages\n");
+    printf("  --jpeg lossless|decode flip and rotate jpegs by moving their DCT blocks, or decode and re-encode them (default %s)\n", LOSSLESS_JPEG ? "lossless" : "decode");
+    printf("  --png-level N          PNG compression level, 0 stores the data, 1 is fastest and 9 smallest (default %d)\n", PNG_LEVEL);
+    printf("  -r, --recursive        process every png/jpg image under the input folder, starting on each as it is found\n");
+    printf("  -n, --dry-run          scan the inputs and print the plan without processing\n");
+    printf("  --self-test            check the SIMD kernels this cpu runs against the scalar code and exit\n");
+    printf("  -h, --help             show this help\n");
+}
 
+//reads a thread or queue count flag, returns 0 unless it is a positive number
+int parse_count(const char* flag, const char* text, int* count) {
+    char extra;
+    if (sscanf(text, "%d%c", count, &extra) != 1 || *count < 1) {
+        printf("Error: %s expects a positive number, got \"%s\".\n", flag, text);
+        return 0;
+    }
+    return 1;
+}
 
-    //each image is an iteration, if an image or pointer is unavailable, proceed to next image
-    omp_set_num_threads(NUM_THREADS);
-#pragma omp parallel for
-    for (int i = 1; i < argc; i++) {
-        int threadId = omp_get_thread_num();
-        
-        //get path for given image
-        char path[256];
-        snprintf(path, sizeof(path), "%s%s", INPUT_FOLDER, argv[i]);
-       
-        //load image
-        int width, height, channels;
-        printf("(%d): loading (%s)...\n", omp_get_thread_num(), argv[i]);
-        unsigned char* img = stbi_load(path, &width, &height, &channels, 0);
-        if (!img) {
-            printf("(%d): Failed to load %s\n", threadId, argv[i]);
-            continue;
+//applies command line flags to settings and ops, *ops_given is set when --ops chose the operations
+//returns the index of the first file argument, 0 to exit successfully (help) or -1 on an invalid flag
+int parse_arguments(int argc, char* argv[], struct operations* ops, int* ops_given) {
+    enum { OPT_OPS = 256, OPT_GRAY, OPT_MODE, OPT_LOAD, OPT_PROCESS, OPT_WRITE, OPT_QUEUE, OPT_READ,
+        OPT_PREFETCH, OPT_PREFETCH_THREADS, OPT_PREFETCH_MB, OPT_IO, OPT_ATOMIC, OPT_HUGE_PAGES, OPT_JPEG, OPT_PNG_LEVEL,
+        OPT_SELF_TEST };
+    static const struct option options[] = {
+        { "ops", required_argument, NULL, OPT_OPS },
+        { "gray", required_argument, NULL, OPT_GRAY },
+        { "input", required_argument, NULL, 'i' },
+        { "output", required_argument, NULL, 'o' },
+        { "threads", required_argument, NULL, 't' },
+        { "mode", required_argument, NULL, OPT_MODE },
+        { "load-threads", required_argument, NULL, OPT_LOAD },
+        { "process-threads", required_argument, NULL, OPT_PROCESS },
+        { "write-threads", required_argument, NULL, OPT_WRITE },
+        { "queue-depth", required_argument, NULL, OPT_QUEUE },
+        { "read", required_argument, NULL, OPT_READ },
+        { "prefetch", required_argument, NULL, OPT_PREFETCH },
+        { "prefetch-threads", required_argument, NULL, OPT_PREFETCH_THREADS },
+        { "prefetch-mb", required_argument, NULL, OPT_PREFETCH_MB },
+        { "io", required_argument, NULL, OPT_IO },
+        { "atomic", no_argument, NULL, OPT_ATOMIC },
+        { "huge-pages", no_argument, NULL, OPT_HUGE_PAGES },
+        { "jpeg", required_argument, NULL, OPT_JPEG },
+        { "png-level", required_argument, NULL, OPT_PNG_LEVEL },
+        { "recursive", no_argument, NULL, 'r' },
+        { "dry-run", no_argument, NULL, 'n' },
+        { "self-test", no_argument, NULL, OPT_SELF_TEST },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    *ops_given = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:o:t:rnh", options, NULL)) != -1) {
+        int ok = 1;
+        switch (opt) {
+        case OPT_OPS:
+            *ops_given = 1;
+            ok = parse_operations(ops, optarg);
+            break;
+        case OPT_GRAY:
+            if (strcmp(optarg, "average") == 0) ops->gray_mode = GRAY_AVERAGE;
+            else if (strcmp(optarg, "bt601") == 0) ops->gray_mode = GRAY_BT601;
+            else if (strcmp(optarg, "bt709") == 0) ops->gray_mode = GRAY_BT709;
+            else {
+                printf("Error: --gray expects average, bt601 or bt709.\n");
+                ok = 0;
+            }
+            break;
+        case 'i': settings.input_folder = optarg; break;
+        case 'o': settings.output_folder = optarg; break;
+        case 't': ok = parse_count("--threads", optarg, &settings.num_threads); break;
+        case OPT_MODE:
+            if (strcmp(optarg, "batch") == 0) settings.pipeline_mode = 0;
+            else if (strcmp(optarg, "pipeline") == 0) settings.pipeline_mode = 1;
+            else {
+                printf("Error: --mode expects batch or pipeline.\n");
+                ok = 0;
+            }
+            break;
+        case OPT_LOAD: ok = parse_count("--load-threads", optarg, &settings.load_threads); break;
+        case OPT_PROCESS: ok = parse_count("--process-threads", optarg, &settings.process_threads); break;
+        case OPT_WRITE: ok = parse_count("--write-threads", optarg, &settings.write_threads); break;
+        case OPT_QUEUE: ok = parse_count("--queue-depth", optarg, &settings.queue_depth); break;
+        case OPT_READ:
+            if (strcmp(optarg, "mmap") == 0) settings.mmap_input = 1;
+            else if (strcmp(optarg, "stdio") == 0) settings.mmap_input = 0;
+            else {
+                printf("Error: --read expects mmap or stdio.\n");
+                ok = 0;
+            }
+            break;
+        case OPT_PREFETCH: ok = parse_count("--prefetch", optarg, &settings.prefetch_files); break;
+        case OPT_PREFETCH_THREADS: ok = parse_count("--prefetch-threads", optarg, &settings.prefetch_threads); break;
+        case OPT_PREFETCH_MB: {
+            int mb;
+            ok = parse_count("--prefetch-mb", optarg, &mb);
+            settings.prefetch_bytes = mb * 1024L * 1024;
+            break;
         }
-        size_t img_size = width * height * channels;
-        //create output image variables
-        unsigned char* output_img = img;
-        int output_channels = channels;
-
-
-        //Start Processing
-        printf("(%d): \tLOADED (%s), processing...\n", omp_get_thread_num(), argv[i]);
-        double start; double end;
-        start = omp_get_wtime();
-
-        //operations (greyscale & sepia mutually exclusive)
-        if (greyscale) {
-            output_channels = (channels == 4) ? 2 : 1;
-            unsigned char* gray_img = malloc(width * height * output_channels);
-            apply_grayscale(img, gray_img, width, height, channels, output_channels);
-            output_img = gray_img;
-        }
-        else if (sepia) {
-            unsigned char* sepia_img = malloc(img_size);
-            apply_sepia(img, sepia_img, width, height, channels);
-            output_img = sepia_img;
-        }
-
-        if (hflip) apply_hflip(output_img, width, height, output_channels);
-        if (vflip) apply_vflip(output_img, width, height, output_channels);
-        if (rotate) {
-            apply_rotate(output_img, width, height, output_channels, rotation);
-            //swaps the height and width for rotation
-            if (rotation == 90 || rotation == 270) {
-                int temp = width;
-                width = height;
-                height = temp;
+        case OPT_IO:
+            if (strcmp(optarg, "uring") == 0) settings.io_uring = 1;
+            else if (strcmp(optarg, "blocking") == 0) settings.io_uring = 0;
+            else {
+                printf("Error: --io expects uring or blocking.\n");
+                ok = 0;
+            }
+            break;
+        case OPT_ATOMIC: settings.atomic_output = 1; break;
+        case OPT_HUGE_PAGES: settings.huge_pages = 1; break;
+        case OPT_JPEG:
+            if (strcmp(optarg, "lossless") == 0) settings.lossless_jpeg = 1;
+            else if (strcmp(optarg, "decode") == 0) settings.lossless_jpeg = 0;
+            else {
+                printf("Error: --jpeg expects lossless or decode.\n");
+                ok = 0;
             }
+            break;
+        case OPT_PNG_LEVEL: {
+            char extra;
+            if (sscanf(optarg, "%d%c", &settings.png_level, &extra) != 1 || settings.png_level < 0 || settings.png_level > 9) {
+                printf("Error: --png-level expects a level from 0 to 9, got \"%s\".\n", optarg);
+                ok = 0;
+            }
+            break;
+        }
+        case 'r': settings.recursive = 1; break;
+        case 'n': settings.dry_run = 1; break;
+        case OPT_SELF_TEST: settings.self_test = 1; break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            ok = 0;
+            break;
         }
+        if (!ok) return -1;
+    }
+    return optind;
+}
 
-        //Processing Timer End
-        end = omp_get_wtime();
+//dry run output: settings, operations and the order the images would be processed in
+void print_plan(const struct operations* ops, struct job_source* source) {
+    if (source->queue) printf("Dry run: every image under \"%s\" to \"%s\"\n", settings.input_folder, settings.output_folder);
+    else printf("Dry run: %d images from \"%s\" to \"%s\"\n", source->file_count, settings.input_folder, settings.output_folder);
+    if (settings.pipeline_mode) {
+        printf("Pipeline mode: %d loader, %d processing and %d writer threads, queue depth %d\n",
+            settings.load_threads, settings.process_threads, settings.write_threads, settings.queue_depth);
+    }
+    else printf("Batch mode: %d threads\n", settings.num_threads);
+    print_operations(ops);
+    struct image_job* job;
+    while ((job = next_job(source)) != NULL) {
+        if (!job->entry) printf("\t%s\n", job->filename);
+        else if (job->entry->est_cost > 0) printf("\t%s: estimated %.1f MB\n", job->filename, job->entry->est_cost / 1e6);
+        else printf("\t%s: unreadable\n", job->filename);
+        free(job);
+    }
+}
 
+//each image is a task, if an image or pointer is unavailable, proceed to next image
+//one thread creates the image tasks and the operations split each image into tile tasks, so threads
+//without an image of their own steal tiles from images still being processed instead of idling
+//once 2 tasks per thread are pending, the creating thread runs the next image itself, which keeps
+//discovered images from piling up as tasks
+void run_batch(struct job_source* source, const struct operations* ops) {
+    int in_flight = 0, limit = 2 * settings.num_threads;
+    omp_set_num_threads(settings.num_threads);
+#pragma omp parallel
+#pragma omp single
+    {
+        struct image_job* job;
+        while ((job = next_job(source)) != NULL) {
+            int pending;
+#pragma omp atomic capture
+            pending = in_flight++;
+#pragma omp task firstprivate(job) if(pending < limit)
+            {
+                if (!transform_jpeg(job, ops) && load_image(job) && process_image(job, ops)) write_image(job);
+                finish_job(source, job);
+#pragma omp atomic
+                in_flight--;
+            }
+        }
+    }
+}
 
+//each thread takes one stage role, images flow loader -> processing -> writer through bounded queues
+//so reading/decoding, processing and encoding/writing of different images overlap
+void run_pipeline(struct job_source* source, const struct operations* ops) {
+    struct job_queue loaded, processed;
+    int load_threads = settings.load_threads, process_threads = settings.process_threads;
+    queue_init(&loaded, settings.queue_depth, load_threads);
+    queue_init(&processed, settings.queue_depth, process_threads);
 
-        //get output file path
-        char out_path[256];
-        snprintf(out_path, sizeof(out_path), "%s%s", OUTPUT_FOLDER, argv[i]);
-        char* ext = get_filename_ext(argv[i]);
-        
-        //Writing to correct filetype (PNG and JPG supported)
-        printf("(%d): \t\tPROCESSED in %f seconds, Writing: (%s)...\n", omp_get_thread_num(), end - start, argv[i]);
-        if (strcmp(ext, "png") == 0) {
-            stbi_write_png(out_path, width, height, output_channels, output_img, width * output_channels);
+    //stage roles are fixed by thread number, so the team must not be shrunk
+    omp_set_dynamic(0);
+#pragma omp parallel num_threads(load_threads + process_threads + settings.write_threads)
+    {
+        int threadId = omp_get_thread_num();
+        if (threadId < load_threads) {
+            //loader stage: claim the next file, decode it and hand it on
+            struct image_job* job;
+            while ((job = next_job(source)) != NULL) {
+                if (transform_jpeg(job, ops)) finish_job(source, job);
+                else if (load_image(job)) queue_push(&loaded, job);
+                else finish_job(source, job);
+            }
+            queue_producer_done(&loaded);
         }
-        else if (strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) {
-            stbi_write_jpg(out_path, width, height, output_channels, output_img, 100);
+        else if (threadId < load_threads + process_threads) {
+            //processing stage, tile tasks of an image are run by the thread that dequeued it
+            //since the other stage threads block on their queues instead of reaching a task scheduling point
+            struct image_job* job;
+            while ((job = queue_pop(&loaded)) != NULL) {
+                if (process_image(job, ops)) queue_push(&processed, job);
+                else finish_job(source, job);
+            }
+            queue_producer_done(&processed);
         }
-        printf("(%d): \t\t\tWRITTEN: (%s)\n", omp_get_thread_num(), out_path);
+        else {
+            //writer stage
+            struct image_job* job;
+            while ((job = queue_pop(&processed)) != NULL) {
+                write_image(job);
+                finish_job(source, job);
+            }
+        }
+    }
+
+    queue_destroy(&loaded);
+    queue_destroy(&processed);
+}
+
+//widths on both sides of the SIMD block sizes, so every kernel also leaves a tail to the scalar loop
+const int SELF_TEST_WIDTHS[] = { 1, 7, 15, 33, 65 };
+#define SELF_TEST_HEIGHT 3
+const char* CPU_LEVEL_NAMES[] = { "scalar", "sse2", "ssse3", "avx2", "avx512vbmi" };
+
+//runs one check of the kernels at cpu_level against the scalar code on the same random image,
+//prints it when they differ and returns 1 when they agree
+int self_test_check(const char* name, void (*op)(unsigned char*, int, int, int), int width, int channels) {
+    unsigned char expected[65 * 4 * SELF_TEST_HEIGHT], actual[65 * 4 * SELF_TEST_HEIGHT];
+    size_t size = (size_t)width * SELF_TEST_HEIGHT * channels;
+    for (size_t i = 0; i < size; i++) expected[i] = (unsigned char)rand();
+    memcpy(actual, expected, size);
+    int level = cpu_level;
+    cpu_level = CPU_SCALAR;
+    op(expected, width, SELF_TEST_HEIGHT, channels);
+    cpu_level = level;
+    op(actual, width, SELF_TEST_HEIGHT, channels);
+    if (memcmp(expected, actual, size) == 0) return 1;
+    printf("FAILED: %s, %s, width %d, %d channels\n", name, CPU_LEVEL_NAMES[level], width, channels);
+    return 0;
+}
+
+//matrix of the color checks
+struct fixed_matrix self_test_matrix;
+
+void self_test_color(unsigned char* img, int width, int height, int channels) {
+    color_matrix_row(img, img, (size_t)width * height, channels, &self_test_matrix);
+}
+
+//--self-test: every SIMD level up to the running cpu's against the scalar code, returns the exit status
+int self_test(void) {
+    detect_cpu();
+#ifdef SIMD_X86
+    build_reverse_masks();
+#endif
+    //an ordinary chain, then extremes: coefficients at the edge of 16 bits and past it, huge offsets
+    struct color_matrix matrices[7] = { saturation_matrix(1.5f), saturation_matrix(3e4f), saturation_matrix(1e5f),
+        saturation_matrix(-1e5f), brightness_matrix(1e6f), brightness_matrix(-1e30f), saturation_matrix(1e12f) };
+    struct color_matrix hue = hue_matrix(100);
+    color_matrix_then(&matrices[0], &hue);
+    int detected = cpu_level, checks = 0, passed = 0;
+    srand(1);
+    for (cpu_level = CPU_SCALAR + 1; cpu_level <= detected; cpu_level++) {
+        for (int channels = 1; channels <= 4; channels++) {
+            for (int w = 0; w < (int)(sizeof(SELF_TEST_WIDTHS) / sizeof(int)); w++) {
+                passed += self_test_check("hflip", hflip_in_place, SELF_TEST_WIDTHS[w], channels);
+                passed += self_test_check("rotate 180", rotate180_in_place, SELF_TEST_WIDTHS[w], channels);
+                checks += 2;
+                for (int m = 0; m < 7 && channels >= 3; m++, checks++) {
+                    fix_color_matrix(&self_test_matrix, &matrices[m]);
+                    passed += self_test_check("color matrix", self_test_color, SELF_TEST_WIDTHS[w], channels);
+                }
+            }
+        }
+    }
+    cpu_level = detected;
+    if (checks == 0) printf("Self test: this cpu runs no SIMD kernels, nothing to check\n");
+    else printf("Self test: %d of %d checks passed on %s and below\n", passed, checks, CPU_LEVEL_NAMES[detected]);
+    return passed != checks;
+}
+
+int main(int argc, char* argv[]) {
+    //Operation bools
+    struct operations ops = { .gray_mode = GRAYSCALE_MODE, .saturation = 1 };
+    int ops_given;
+    int first_file = parse_arguments(argc, argv, &ops, &ops_given);
+    if (first_file <= 0) return first_file < 0;
+
+    if (settings.self_test) return self_test();
+
+    //Input Validation: filenames are provided, or found by recursive input
+    if (settings.recursive && first_file < argc) {
+        printf("Error: --recursive takes its images from the input folder, don't list filenames.\n");
+        return 1;
+    }
+    if (!settings.recursive && first_file >= argc) {
+        printf("Error: Provide image filenames.\n");
+        return 1;
+    }
+    
+    detect_cpu();
+    stbi_write_png_compression_level = settings.png_level;
+#ifdef SIMD_X86
+    build_reverse_masks();
+#endif
+    if (!ops_given) read_operations(&ops);
+    if (settings.io_uring && !settings.dry_run && !thread_ring()) {
+        printf("io_uring is unavailable, using blocking I/O\n");
+        settings.io_uring = 0;
+    }
+
+    //start total timer after input
+    double input_start = omp_get_wtime();
+
+    struct job_source source = { NULL };
+    struct job_queue discovered;
+    pthread_t discovery;
+    if (settings.recursive) {
+        //files are found while the batch runs, so there is no pre-scan or largest-first order
+        queue_init(&discovered, DISCOVERY_DEPTH, 1);
+        source.queue = &discovered;
+        pthread_create(&discovery, NULL, discover_files, &discovered);
+    }
+    else {
+        //header pre-scan, then largest images first so the big ones don't end up in the batch tail
+        source.file_count = argc - first_file;
+        source.entries = malloc(source.file_count * sizeof(struct file_entry));
+        scan_files(source.entries, argv + first_file, source.file_count);
+        qsort(source.entries, source.file_count, sizeof(struct file_entry), compare_cost_desc);
+    }
 
-        stbi_image_free(img);
-        if (output_img != img) free(output_img);
+    //read-ahead sits between the file source and the run
+    struct prefetcher prefetcher;
+    struct job_source* run_source = &source;
+    int prefetch = settings.prefetch_files > 0 && !settings.dry_run;
+    if (prefetch) {
+        prefetch_start(&prefetcher, &source);
+        run_source = &prefetcher.output;
     }
 
+    if (settings.dry_run) print_plan(&ops, &source);
+    else if (settings.pipeline_mode) run_pipeline(run_source, &ops);
+    else run_batch(run_source, &ops);
+
     //Mark completion time
     double input_end = omp_get_wtime();
 
-    printf("Completed all images in %f seconds using %d threads\n", input_end - input_start, NUM_THREADS);
+    if (prefetch) prefetch_stop(&prefetcher);
+
+    if (settings.recursive) {
+        pthread_join(discovery, NULL);
+        queue_destroy(&discovered);
+    }
+    if (!settings.dry_run) {
+        if (settings.pipeline_mode) {
+            printf("Completed all images in %f seconds using %d loader, %d processing and %d writer threads\n",
+                input_end - input_start, settings.load_threads, settings.process_threads, settings.write_threads);
+        }
+        else printf("Completed all images in %f seconds using %d threads\n", input_end - input_start, settings.num_threads);
+        if (settings.recursive) printf("Finished %d discovered images in %f thread-seconds\n", run_source->finished, run_source->seconds);
+        else print_cost_summary(source.entries, source.file_count);
+        print_pool_stats();
+    }
+    free(source.entries);
     return 0;
-}
\ No newline at end of file
+}